@@ -22,13 +22,15 @@
 
  */
 
-// compile with gcc -Wall -o day01 ./day01.c
+// compile with gcc -Wall -o day01 ./day01.c ./sort.c
 // run with ./day01 input_day01.txt
 
 #include<stdbool.h>
 #include<stdio.h>
 #include<stdlib.h>
 
+#include "sort.h"
+
 #define YEAR 2020
 #define BUFSIZE 1024
 
@@ -59,17 +61,13 @@ int *read_numbers(char *filename, int *N) {
 	return nums;
 }
 
-int cmp(const void *a, const void *b) {
-	return (*(int *)a - *(int *)b);
-}
-
 int find_product_two(int *nums, int N)
 {
 	int i, ans, lidx, ridx;
 	int *diffs = NULL;
 
 	// sort the input array
-	qsort(nums, N, sizeof(int), cmp);
+	sort_ints(nums, N);
 
 	// create a difference array
 	diffs = malloc(N * sizeof(int));
@@ -105,7 +103,7 @@ int find_product_three(int *nums, int N)
 	int L, R, M;
 
 	// sort the array
-	qsort(nums, N, sizeof(int), cmp);
+	sort_ints(nums, N);
 
 	lidx = 0;
 	ridx = N-1;
@@ -0,0 +1,160 @@
+/**
+ * @file sort.c
+ * @author G.J.J. van den Burg
+ * @date 2020-12-10
+ * @brief Radix and counting sort for int arrays
+
+ * Copyright (C) G.J.J. van den Burg
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+ */
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include "sort.h"
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (32 / RADIX_BITS)
+
+void *Malloc(size_t size)
+{
+	void *out = malloc(size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+void *Calloc(size_t n, size_t size)
+{
+	void *out = calloc(n, size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+/** @brief Sort an array of ints whose values all lie in [min, max]
+ *
+ * We count how often every value occurs and then write the values back in
+ * order, so this is O(N + max - min).
+ */
+void counting_sort(int *nums, int N, int min, int max)
+{
+	int i, v, k = 0;
+	size_t range = (size_t) ((long) max - min) + 1;
+	int *counts = Calloc(range, sizeof(int));
+
+	for (i=0; i<N; i++)
+		counts[nums[i] - min]++;
+
+	for (v=0; v<(long) range; v++)
+		for (i=0; i<counts[v]; i++)
+			nums[k++] = min + v;
+
+	free(counts);
+}
+
+/** @brief LSD radix sort of an array of ints
+ *
+ * The sign bit is flipped so negative numbers end up in front. All digit
+ * histograms are built in a single pass over the data, and a pass is skipped
+ * entirely when every element has the same digit (which is the case for the
+ * high bytes of small numbers).
+ */
+void radix_sort(int *nums, int N)
+{
+	int i, p, d;
+	unsigned int key;
+	size_t counts[RADIX_PASSES][RADIX_SIZE];
+	size_t offset, tmp;
+
+	if (N < 2)
+		return;
+
+	memset(counts, 0, sizeof(counts));
+	for (i=0; i<N; i++) {
+		key = ((unsigned int) nums[i]) ^ 0x80000000u;
+		for (p=0; p<RADIX_PASSES; p++)
+			counts[p][(key >> (p * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+	}
+
+	int *buf = Malloc(sizeof(int) * N);
+	int *src = nums,
+	    *dst = buf,
+	    *swap = NULL;
+
+	for (p=0; p<RADIX_PASSES; p++) {
+		// skip this pass if all elements share the digit
+		d = (((unsigned int) src[0] ^ 0x80000000u) >> (p * RADIX_BITS))
+			& (RADIX_SIZE - 1);
+		if (counts[p][d] == (size_t) N)
+			continue;
+
+		// turn the counts into starting offsets
+		offset = 0;
+		for (d=0; d<RADIX_SIZE; d++) {
+			tmp = counts[p][d];
+			counts[p][d] = offset;
+			offset += tmp;
+		}
+
+		for (i=0; i<N; i++) {
+			key = ((unsigned int) src[i]) ^ 0x80000000u;
+			d = (key >> (p * RADIX_BITS)) & (RADIX_SIZE - 1);
+			dst[counts[p][d]++] = src[i];
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != nums)
+		memcpy(nums, src, sizeof(int) * N);
+	free(buf);
+}
+
+/** @brief Sort an array of ints in ascending order
+ *
+ * Uses counting sort when the range of values is small compared to the
+ * number of elements and radix sort otherwise.
+ */
+void sort_ints(int *nums, int N)
+{
+	int i, min, max;
+	long range;
+
+	if (N < 2)
+		return;
+
+	min = max = nums[0];
+	for (i=1; i<N; i++) {
+		if (nums[i] < min) min = nums[i];
+		if (nums[i] > max) max = nums[i];
+	}
+
+	range = (long) max - min + 1;
+	if (range <= (long) N * COUNTING_SORT_FACTOR &&
+			range <= COUNTING_SORT_MAX_RANGE)
+		counting_sort(nums, N, min, max);
+	else
+		radix_sort(nums, N);
+}
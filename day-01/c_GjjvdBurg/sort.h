@@ -0,0 +1,40 @@
+/**
+ * @file sort.h
+ * @author G.J.J. van den Burg
+ * @date 2020-12-10
+ * @brief Header file for sort.c
+
+ * Copyright (C) G.J.J. van den Burg
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef _SORT_H_
+#define _SORT_H_
+
+#include <stddef.h>
+
+// use counting sort when the value range is at most this many times the
+// number of elements (and never for ranges above COUNTING_SORT_MAX_RANGE)
+#define COUNTING_SORT_FACTOR 4
+#define COUNTING_SORT_MAX_RANGE (1 << 20)
+
+void *Malloc(size_t size);
+void *Calloc(size_t n, size_t size);
+void counting_sort(int *nums, int N, int min, int max);
+void radix_sort(int *nums, int N);
+void sort_ints(int *nums, int N);
+
+#endif
@@ -22,106 +22,457 @@
 
  */
 
+// compile with gcc -Wall -O2 -march=native -pthread -o day02 ./day02.c
+// run with ./day02 input_day02.txt [n_threads]
+// or stream from stdin with ./day02 - < input_day02.txt
+
+#include<fcntl.h>
+#include<pthread.h>
 #include<stdbool.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+#if defined(__AVX2__)
+#include<immintrin.h>
+#elif defined(__SSE2__)
+#include<emmintrin.h>
+#endif
 
-#define BUFSIZE 1024
+#define INIT_CAPACITY 1024
 
+// A single record. The password is a view into the input buffer and is not
+// null-terminated.
 struct Record {
 	int min_range;
 	int max_range;
 	char letter;
-	char *password;
+	const char *password;
+	int length;
+};
+
+// Structure-of-arrays store of all records. Passwords are stored as offsets
+// and lengths into the mapped input file, so no record owns any memory.
+struct RecordStore {
+	size_t n;
+	size_t capacity;
+	int *min_range;
+	int *max_range;
+	char *letter;
+	size_t *pw_offset;
+	int *pw_length;
+	const char *data;
+	size_t size;
+};
+
+// A newline-aligned piece of the input that is validated by one thread
+struct Chunk {
+	const char *start;
+	const char *end;
+	long valid_one;
+	long valid_two;
 };
 
-struct Record **read_file(char *filename, int *N)
+void *Malloc(size_t size)
+{
+	void *out = malloc(size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+void *Realloc(void *ptr, size_t size)
+{
+	void *out = realloc(ptr, size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+const char *map_file(char *filename, size_t *size)
+{
+	int fd;
+	struct stat st;
+	const char *data = NULL;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error opening file %s for reading.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error reading size of file %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	*size = st.st_size;
+	if (*size > 0) {
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Error mapping file %s.\n", filename);
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+
+	return data;
+}
+
+void unmap_file(const char *data, size_t size)
+{
+	if (data != NULL)
+		munmap((void *) data, size);
+}
+
+/** @brief Parse a single line of the form "1-3 a: abcde"
+ *
+ * Returns a pointer to the start of the next line, or NULL if the line
+ * starting at p is malformed. Empty lines are reported with length -1.
+ */
+const char *parse_record(const char *p, const char *end, struct Record *r)
 {
-	int i, a, b, n_lines = 0;
-	char buf[BUFSIZE];
-	char c, pass[BUFSIZE];
-	FILE *fp = NULL;
+	int a = 0, b = 0;
+
+	if (p < end && *p == '\n') {
+		r->length = -1;
+		return p + 1;
+	}
+
+	if (p == end || *p < '0' || *p > '9')
+		return NULL;
+	while (p < end && '0' <= *p && *p <= '9')
+		a = 10 * a + (*p++ - '0');
+	if (p == end || *p++ != '-')
+		return NULL;
+
+	if (p == end || *p < '0' || *p > '9')
+		return NULL;
+	while (p < end && '0' <= *p && *p <= '9')
+		b = 10 * b + (*p++ - '0');
+	if (p == end || *p++ != ' ')
+		return NULL;
+
+	if (end - p < 3 || p[1] != ':' || p[2] != ' ')
+		return NULL;
+	r->letter = p[0];
+	p += 3;
 
-	// figure out how many lines we have
-	fp = fopen(filename, "r");
-	while (fgets(buf, BUFSIZE, fp) != NULL)
-		n_lines++;
+	r->min_range = a;
+	r->max_range = b;
+	r->password = p;
+	while (p < end && *p != '\n' && *p != '\r')
+		p++;
+	r->length = p - r->password;
 
-	fseek(fp, 0, SEEK_SET);
+	while (p < end && *p != '\n')
+		p++;
+	return p < end ? p + 1 : p;
+}
+
+void store_push(struct RecordStore *S, struct Record *r)
+{
+	if (S->n == S->capacity) {
+		S->capacity *= 2;
+		S->min_range = Realloc(S->min_range, sizeof(int) * S->capacity);
+		S->max_range = Realloc(S->max_range, sizeof(int) * S->capacity);
+		S->letter = Realloc(S->letter, sizeof(char) * S->capacity);
+		S->pw_offset = Realloc(S->pw_offset, sizeof(size_t) * S->capacity);
+		S->pw_length = Realloc(S->pw_length, sizeof(int) * S->capacity);
+	}
+	S->min_range[S->n] = r->min_range;
+	S->max_range[S->n] = r->max_range;
+	S->letter[S->n] = r->letter;
+	S->pw_offset[S->n] = r->password - S->data;
+	S->pw_length[S->n] = r->length;
+	S->n++;
+}
+
+void store_get(struct RecordStore *S, size_t i, struct Record *r)
+{
+	r->min_range = S->min_range[i];
+	r->max_range = S->max_range[i];
+	r->letter = S->letter[i];
+	r->password = S->data + S->pw_offset[i];
+	r->length = S->pw_length[i];
+}
+
+struct RecordStore *read_file(char *filename)
+{
+	size_t line = 1;
+	struct Record r;
+	struct RecordStore *S = Malloc(sizeof(struct RecordStore));
 
-	struct Record **Rs = malloc(n_lines * sizeof(struct Record *));
-	for (i=0; i<n_lines; i++) {
-		fgets(buf, BUFSIZE, fp);
-		sscanf(buf, "%d-%d %c: %s", &a, &b, &c, pass);
+	S->data = map_file(filename, &S->size);
+	S->n = 0;
+	S->capacity = INIT_CAPACITY;
+	S->min_range = Malloc(sizeof(int) * S->capacity);
+	S->max_range = Malloc(sizeof(int) * S->capacity);
+	S->letter = Malloc(sizeof(char) * S->capacity);
+	S->pw_offset = Malloc(sizeof(size_t) * S->capacity);
+	S->pw_length = Malloc(sizeof(int) * S->capacity);
 
-		Rs[i] = malloc(sizeof(struct Record));
-		Rs[i]->min_range = a;
-		Rs[i]->max_range = b;
-		Rs[i]->letter = c;
-		Rs[i]->password = malloc((strlen(pass)+1)*sizeof(char));
-		strcpy(Rs[i]->password, pass);
+	const char *p = S->data,
+	      *end = S->data + S->size;
+	while (p < end) {
+		if ((p = parse_record(p, end, &r)) == NULL) {
+			fprintf(stderr, "Error parsing line %zu of %s.\n",
+					line, filename);
+			exit(EXIT_FAILURE);
+		}
+		if (r.length >= 0)
+			store_push(S, &r);
+		line++;
 	}
-	fclose(fp);
 
-	*N = n_lines;
-	return Rs;
+	return S;
 }
 
-int count_letter_occurrence(char c, char *str)
+void store_free(struct RecordStore *S)
 {
-	size_t i, count = 0;
-	size_t n = strlen(str);
-	for (i=0; i<n; i++)
+	free(S->min_range);
+	free(S->max_range);
+	free(S->letter);
+	free(S->pw_offset);
+	free(S->pw_length);
+	unmap_file(S->data, S->size);
+	free(S);
+}
+
+// Loads of VEC_WIDTH bytes that stay within one page can not fault, so the
+// tail of a password is read with a full vector load when possible.
+#define PAGE_SIZE 4096
+#define SAFE_LOAD(p) ((((uintptr_t) (p)) & (PAGE_SIZE - 1)) <= PAGE_SIZE - VEC_WIDTH)
+
+#if defined(__AVX2__)
+#define VEC_WIDTH 32
+#elif defined(__SSE2__)
+#define VEC_WIDTH 16
+#endif
+
+#ifdef VEC_WIDTH
+static inline unsigned int match_mask(char c, const char *str)
+{
+#if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *) str);
+	__m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+	return (unsigned int) _mm256_movemask_epi8(m);
+#else
+	__m128i v = _mm_loadu_si128((const __m128i *) str);
+	__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+	return (unsigned int) _mm_movemask_epi8(m);
+#endif
+}
+#endif
+
+/** @brief Count how often c occurs in the first n bytes of str
+ *
+ * With SSE2 or AVX2 available we compare a full vector of bytes against the
+ * letter at once and popcount the resulting mask. Most passwords fit in a
+ * single vector, so they are counted with one load.
+ */
+int count_letter_occurrence(char c, const char *str, int n)
+{
+	int i = 0, count = 0;
+#ifdef VEC_WIDTH
+	for (; i + VEC_WIDTH <= n; i += VEC_WIDTH)
+		count += __builtin_popcount(match_mask(c, str + i));
+	if (i < n && SAFE_LOAD(str + i)) {
+		unsigned int keep = (1u << (n - i)) - 1;
+		return count + __builtin_popcount(match_mask(c, str + i) & keep);
+	}
+#endif
+	for (; i<n; i++)
 		count += str[i] == c;
 	return count;
 }
 
 bool is_valid_record_part_1(struct Record *r)
 {
-	int count = count_letter_occurrence(r->letter, r->password);
+	int count = count_letter_occurrence(r->letter, r->password, r->length);
 	return (r->min_range <= count && count <= r->max_range);
 }
 
+bool letter_at(struct Record *r, int pos)
+{
+	return 1 <= pos && pos <= r->length && r->password[pos - 1] == r->letter;
+}
+
 bool is_valid_record_part_2(struct Record *r)
 {
-	return (r->password[r->min_range - 1] == r->letter) ^
-		(r->password[r->max_range - 1] == r->letter);
+	return letter_at(r, r->min_range) ^ letter_at(r, r->max_range);
 }
 
-void print_record(struct Record *r)
+/** @brief Parse and validate all records in a chunk under both policies
+ *
+ * Records are validated as soon as they're parsed, so the chunk never needs
+ * to be stored.
+ */
+void *count_valid_chunk(void *arg)
 {
-	printf("Record(%d, %d, %c, %s)\n", r->min_range, r->max_range,
-			r->letter, r->password);
+	struct Chunk *C = arg;
+	struct Record r;
+	const char *p = C->start;
+	long one = 0,
+	     two = 0;
+
+	// count in locals, as the chunks of different threads share cache
+	// lines
+	while (p < C->end) {
+		if ((p = parse_record(p, C->end, &r)) == NULL) {
+			fprintf(stderr, "Error parsing input.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (r.length < 0)
+			continue;
+		one += is_valid_record_part_1(&r);
+		two += is_valid_record_part_2(&r);
+	}
+	C->valid_one = one;
+	C->valid_two = two;
+	return NULL;
 }
 
-int main(int argc, char **argv)
+/** @brief Count valid records in the mapped input using n_threads threads
+ *
+ * The input is split in roughly equal parts, where every split point is moved
+ * forward to the start of the next line. Each thread counts its own chunk and
+ * the counts are summed afterwards.
+ */
+void count_valid_parallel(const char *data, size_t size, int n_threads,
+		long *valid_one, long *valid_two)
 {
-	if (argc != 2) {
-		printf("Usage: %s input_file\n", argv[0]);
-		return EXIT_FAILURE;
+	int k;
+	const char *p = NULL,
+	      *end = data + size;
+	struct Chunk *chunks = Malloc(sizeof(struct Chunk) * n_threads);
+	pthread_t *threads = Malloc(sizeof(pthread_t) * n_threads);
+
+	p = data;
+	for (k=0; k<n_threads; k++) {
+		chunks[k].start = p;
+		if (k == n_threads - 1) {
+			p = end;
+		} else {
+			p = data + (size / n_threads) * (k + 1);
+			if (p < chunks[k].start)
+				p = chunks[k].start;
+			p = memchr(p, '\n', end - p);
+			p = (p == NULL) ? end : p + 1;
+		}
+		chunks[k].end = p;
 	}
 
-	int i, N, ans = 0;
-	struct Record **records = read_file(argv[1], &N);
+	for (k=0; k<n_threads; k++) {
+		if (pthread_create(&threads[k], NULL, count_valid_chunk,
+					&chunks[k]) != 0) {
+			fprintf(stderr, "Error creating thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	for (i=0; i<N; i++)
-		ans += is_valid_record_part_1(records[i]);
+	*valid_one = *valid_two = 0;
+	for (k=0; k<n_threads; k++) {
+		pthread_join(threads[k], NULL);
+		*valid_one += chunks[k].valid_one;
+		*valid_two += chunks[k].valid_two;
+	}
 
-	printf("Solution part 1: %d\n", ans);
+	free(threads);
+	free(chunks);
+}
 
-	ans = 0;
-	for (i=0; i<N; i++)
-		ans += is_valid_record_part_2(records[i]);
+/** @brief Count valid records read line by line from a stream
+ *
+ * Every line is parsed and validated under both policies as soon as it is
+ * read, so memory use only depends on the longest line and not on the size
+ * of the input. This works for pipes and for inputs larger than memory. The
+ * line buffer is padded with VEC_WIDTH bytes for count_letter_occurrence.
+ */
+void count_valid_stream(FILE *fp, long *valid_one, long *valid_two)
+{
+	char *line = NULL;
+	size_t cap = 0,
+	       lineno = 0;
+	ssize_t len;
+	struct Record r;
 
-	printf("Solution part 2: %d\n", ans);
+	*valid_one = *valid_two = 0;
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		lineno++;
+#ifdef VEC_WIDTH
+		// pad the line, so that the vector load of the tail of the
+		// password stays inside the buffer
+		if (cap < (size_t) len + VEC_WIDTH) {
+			cap = len + VEC_WIDTH;
+			line = Realloc(line, cap);
+		}
+		memset(line + len, 0, VEC_WIDTH);
+#endif
+		if (parse_record(line, line + len, &r) == NULL) {
+			fprintf(stderr, "Error parsing line %zu.\n", lineno);
+			exit(EXIT_FAILURE);
+		}
+		if (r.length < 0)
+			continue;
+		*valid_one += is_valid_record_part_1(&r);
+		*valid_two += is_valid_record_part_2(&r);
+	}
+	free(line);
+}
+
+void print_record(struct Record *r)
+{
+	printf("Record(%d, %d, %c, %.*s)\n", r->min_range, r->max_range,
+			r->letter, r->length, r->password);
+}
 
-	// clean up
-	for (i=0; i<N; i++) {
-		free(records[i]->password);
-		free(records[i]);
+int main(int argc, char **argv)
+{
+	if (argc != 2 && argc != 3) {
+		printf("Usage: %s input_file [n_threads]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int n_threads = (argc == 3) ? atoi(argv[2]) : 1;
+	long valid_one = 0,
+	     valid_two = 0;
+	size_t i, size;
+	struct Record r;
+
+	if (n_threads < 1) {
+		fprintf(stderr, "Number of threads must be positive.\n");
+		return EXIT_FAILURE;
 	}
-	free(records);
+
+	if (strcmp(argv[1], "-") == 0) {
+		count_valid_stream(stdin, &valid_one, &valid_two);
+	} else if (n_threads > 1) {
+		const char *data = map_file(argv[1], &size);
+		count_valid_parallel(data, size, n_threads, &valid_one,
+				&valid_two);
+		unmap_file(data, size);
+	} else {
+		struct RecordStore *S = read_file(argv[1]);
+		for (i=0; i<S->n; i++) {
+			store_get(S, i, &r);
+			valid_one += is_valid_record_part_1(&r);
+		}
+		for (i=0; i<S->n; i++) {
+			store_get(S, i, &r);
+			valid_two += is_valid_record_part_2(&r);
+		}
+		store_free(S);
+	}
+
+	printf("Solution part 1: %ld\n", valid_one);
+	printf("Solution part 2: %ld\n", valid_two);
 
 	return EXIT_SUCCESS;
 }
@@ -22,64 +22,183 @@
 
  */
 
+#include<pthread.h>
+#include<stdbool.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<time.h>
 #include<assert.h>
 
 #define CLEAR 0
 #define TREE 1
-#define BUFSIZE 1024
+#define WORD_BITS 64
+#define WORD_SHIFT 6
 
+// compile with gcc -Wall -O2 -pthread -o day03 ./day03.c
+// run with ./day03 input_day03.txt
+// or stream from stdin with ./day03 - < input_day03.txt
+// or search all slopes with
+//   ./day03 input_day03.txt search max_down top_n fewest|most [n_threads]
+
+// The field is stored as one bitset per row, with bit c of a row set if
+// there's a tree in column c. Rows are padded to a whole number of words.
 struct Field {
 	int width;
 	int height;
-	int *map;
+	int words;
+	uint64_t *map;
+};
+
+// Cursor of a single slope while walking down the field
+struct Slope {
+	int right;
+	int down;
+	int step; // right, reduced modulo the width
+	int col;
+	int next_row;
+	long trees;
+};
+
+// The slopes of part two. Part one uses the second one.
+#define N_SLOPES 5
+const struct Slope SLOPES[N_SLOPES] = {
+	{ .right = 1, .down = 1 },
+	{ .right = 3, .down = 1 },
+	{ .right = 5, .down = 1 },
+	{ .right = 7, .down = 1 },
+	{ .right = 1, .down = 2 },
+};
+
+struct SlopeResult {
+	int right;
+	int down;
+	int trees;
+};
+
+// Work for a single search thread: every stride-th slope starting at first
+struct SearchJob {
+	struct Field *F;
+	int max_down;
+	int first;
+	int stride;
+	struct SlopeResult *results;
 };
 
 void map_set(struct Field *f, int r, int c, int v)
 {
-	// row-major order
-	f->map[r*f->width + c] = v;
+	uint64_t *w = &f->map[r*f->words + (c >> WORD_SHIFT)];
+	uint64_t bit = ((uint64_t) 1) << (c & (WORD_BITS - 1));
+	if (v == TREE)
+		*w |= bit;
+	else
+		*w &= ~bit;
 }
 
+int row_get(const uint64_t *row, int c)
+{
+	return (row[c >> WORD_SHIFT] >> (c & (WORD_BITS - 1))) & 1;
+}
+
+// note: c must be in [0, width), wrapping is left to the caller
 int map_get(struct Field *f, int r, int c) {
-	return f->map[r*f->width + (c % f->width)];
+	return row_get(&f->map[r*f->words], c);
+}
+
+void *Malloc(size_t size)
+{
+	void *out = malloc(size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+void *Realloc(void *ptr, size_t size)
+{
+	void *out = realloc(ptr, size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+// Read the next non-empty row into line and return its length without the
+// newline, or -1 at the end of the input.
+ssize_t read_row(FILE *fp, char **line, size_t *cap)
+{
+	ssize_t len;
+	while ((len = getline(line, cap, fp)) != -1) {
+		while (len > 0 && ((*line)[len-1] == '\n' || (*line)[len-1] == '\r'))
+			len--;
+		if (len > 0)
+			return len;
+	}
+	return -1;
+}
+
+void parse_row(const char *line, int width, uint64_t *row)
+{
+	int j, words = (width + WORD_BITS - 1) / WORD_BITS;
+	memset(row, 0, sizeof(uint64_t) * words);
+	for (j=0; j<width; j++) {
+		assert(line[j] == '.' || line[j] == '#');
+		if (line[j] == '#')
+			row[j >> WORD_SHIFT] |= ((uint64_t) 1) << (j & (WORD_BITS - 1));
+	}
 }
 
 struct Field *read_file(char *filename)
 {
-	char buf[BUFSIZE];
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
 	FILE *fp = NULL;
-	int i, j,
-	    height = 0,
-	    width = 0;
-
-	fp = fopen(filename, "r");
-	while (fgets(buf, BUFSIZE, fp) != NULL)
-		height++;
-	width = strlen(buf) - 1; // subtract newline
-
-	fseek(fp, 0, SEEK_SET);
-
-	struct Field *F = malloc(sizeof(struct Field));
-	F->width = width;
-	F->height = height;
-	F->map = malloc(sizeof(int) * (width * height));
-
-	for (i=0; i<height; i++) {
-		fgets(buf, BUFSIZE, fp);
-		for (j=0; j<width; j++) {
-			assert(buf[j] == '.' || buf[j] == '#');
-			if (buf[j] == '.')
-				map_set(F, i, j, CLEAR);
-			else
-				map_set(F, i, j, TREE);
+	int capacity = 0;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "Error opening file %s for reading.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	struct Field *F = Malloc(sizeof(struct Field));
+	F->width = 0;
+	F->height = 0;
+	F->words = 0;
+	F->map = NULL;
+
+	while ((len = read_row(fp, &line, &cap)) != -1) {
+		// the width is set by the first row
+		if (F->height == 0) {
+			F->width = len;
+			F->words = (len + WORD_BITS - 1) / WORD_BITS;
+		}
+		if (len != F->width) {
+			fprintf(stderr, "Row %d has width %zd instead of %d.\n",
+					F->height + 1, len, F->width);
+			exit(EXIT_FAILURE);
+		}
+
+		if (F->height == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			F->map = Realloc(F->map,
+					sizeof(uint64_t) * F->words * capacity);
 		}
+		parse_row(line, F->width, &F->map[F->height * F->words]);
+		F->height++;
 	}
 
+	free(line);
 	fclose(fp);
 
+	if (F->height == 0) {
+		fprintf(stderr, "Input contains no data.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	return F;
 }
 
@@ -98,47 +217,279 @@ int tree_count(struct Field *F, int right, int down)
 	int r = 0,
 	    c = 0,
 	    trees = 0;
+
+	// reduce the step once so the wrap below needs a single subtraction
+	right %= F->width;
+
 	while (r + down < F->height) {
 		r += down;
 		c += right;
+		if (c >= F->width)
+			c -= F->width;
 		trees += map_get(F, r, c) == TREE;
 	}
 	return trees;
 }
 
+void slopes_init(struct Slope *slopes, int n, int width)
+{
+	for (int i=0; i<n; i++) {
+		slopes[i].step = slopes[i].right % width;
+		slopes[i].col = 0;
+		slopes[i].next_row = slopes[i].down;
+		slopes[i].trees = 0;
+	}
+}
+
+/** @brief Move all slopes that land on row r one step forward
+ *
+ * Every slope keeps track of the next row it lands on, so no division is
+ * needed to figure out whether a slope visits the current row.
+ */
+void slopes_advance(struct Slope *slopes, int n, const uint64_t *row, int r,
+		int width)
+{
+	struct Slope *s = NULL;
+	for (int i=0; i<n; i++) {
+		s = &slopes[i];
+		if (s->next_row != r)
+			continue;
+		s->col += s->step;
+		if (s->col >= width)
+			s->col -= width;
+		s->trees += row_get(row, s->col) == TREE;
+		s->next_row += s->down;
+	}
+}
+
+/** @brief Count the trees for a list of slopes in a single pass
+ *
+ * Instead of walking the field once per slope, all slope cursors are moved
+ * along together, so that every row is read only once regardless of the
+ * number of slopes. The counts end up in the trees field of each slope.
+ */
+void tree_count_slopes(struct Field *F, struct Slope *slopes, int n)
+{
+	slopes_init(slopes, n, F->width);
+	for (int r=1; r<F->height; r++)
+		slopes_advance(slopes, n, &F->map[r*F->words], r, F->width);
+}
+
+/** @brief Count the trees for a list of slopes on a field read from a stream
+ *
+ * Rows are processed as they are read, and only the current row is kept in
+ * memory, so this uses O(width) memory and works on fields that are too
+ * large to load (or that come from a pipe).
+ */
+void stream_tree_count_slopes(FILE *fp, struct Slope *slopes, int n)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int r, width;
+
+	// the first row only fixes the width, since all slopes start there
+	if ((len = read_row(fp, &line, &cap)) == -1) {
+		fprintf(stderr, "Input contains no data.\n");
+		exit(EXIT_FAILURE);
+	}
+	width = len;
+	slopes_init(slopes, n, width);
+
+	uint64_t *row = Malloc(sizeof(uint64_t) *
+			((width + WORD_BITS - 1) / WORD_BITS));
+	for (r=1; (len = read_row(fp, &line, &cap)) != -1; r++) {
+		if (len != width) {
+			fprintf(stderr, "Row %d has width %zd instead of %d.\n",
+					r + 1, len, width);
+			exit(EXIT_FAILURE);
+		}
+		parse_row(line, width, row);
+		slopes_advance(slopes, n, row, r, width);
+	}
+
+	free(row);
+	free(line);
+}
+
 int solve_part_one(struct Field *F) {
 	return tree_count(F, 3, 1);
 }
 
-long solve_part_two(struct Field *F) {
+long slopes_product(struct Slope *slopes, int n)
+{
 	long prod = 1;
-	prod *= tree_count(F, 1, 1);
-	prod *= tree_count(F, 3, 1);
-	prod *= tree_count(F, 5, 1);
-	prod *= tree_count(F, 7, 1);
-	prod *= tree_count(F, 1, 2);
+	for (int i=0; i<n; i++)
+		prod *= slopes[i].trees;
 	return prod;
 }
 
+long solve_part_two(struct Field *F) {
+	struct Slope slopes[N_SLOPES];
+	memcpy(slopes, SLOPES, sizeof(SLOPES));
+	tree_count_slopes(F, slopes, N_SLOPES);
+	return slopes_product(slopes, N_SLOPES);
+}
+
+void *search_worker(void *arg)
+{
+	struct SearchJob *job = arg;
+	int i, right, down,
+	    n_right = job->F->width - 1,
+	    n = n_right * job->max_down;
+
+	// interleave the slopes so steep and shallow ones are spread evenly
+	for (i=job->first; i<n; i+=job->stride) {
+		right = 1 + i % n_right;
+		down = 1 + i / n_right;
+		job->results[i].right = right;
+		job->results[i].down = down;
+		job->results[i].trees = tree_count(job->F, right, down);
+	}
+	return NULL;
+}
+
+int cmp_fewest(const void *a, const void *b)
+{
+	const struct SlopeResult *x = a, *y = b;
+	if (x->trees != y->trees)
+		return x->trees < y->trees ? -1 : 1;
+	if (x->down != y->down)
+		return x->down - y->down;
+	return x->right - y->right;
+}
+
+int cmp_most(const void *a, const void *b)
+{
+	const struct SlopeResult *x = a, *y = b;
+	if (x->trees != y->trees)
+		return x->trees > y->trees ? -1 : 1;
+	return cmp_fewest(a, b);
+}
+
+/** @brief Evaluate all slopes with right in [1, width) and down in [1,
+ * max_down] and return them sorted by tree count
+ *
+ * The field is only read, so it's shared between all threads. Every thread
+ * writes its counts in its own slots of the results array.
+ */
+struct SlopeResult *search_slopes(struct Field *F, int max_down, bool fewest,
+		int n_threads, int *N)
+{
+	int k, n = (F->width - 1) * max_down;
+	struct SlopeResult *results = Malloc(sizeof(struct SlopeResult) *
+			(n > 0 ? n : 1));
+	struct SearchJob *jobs = Malloc(sizeof(struct SearchJob) * n_threads);
+	pthread_t *threads = Malloc(sizeof(pthread_t) * n_threads);
+
+	for (k=0; k<n_threads; k++) {
+		jobs[k].F = F;
+		jobs[k].max_down = max_down;
+		jobs[k].first = k;
+		jobs[k].stride = n_threads;
+		jobs[k].results = results;
+		if (pthread_create(&threads[k], NULL, search_worker,
+					&jobs[k]) != 0) {
+			fprintf(stderr, "Error creating thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (k=0; k<n_threads; k++)
+		pthread_join(threads[k], NULL);
+
+	qsort(results, n, sizeof(struct SlopeResult),
+			fewest ? cmp_fewest : cmp_most);
+
+	free(threads);
+	free(jobs);
+
+	*N = n;
+	return results;
+}
+
+double wall_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+int run_search(struct Field *F, int argc, char **argv)
+{
+	int i, n, max_down, top_n, n_threads = 1;
+	bool fewest;
+
+	max_down = atoi(argv[3]);
+	top_n = atoi(argv[4]);
+	if (strcmp(argv[5], "fewest") == 0)
+		fewest = true;
+	else if (strcmp(argv[5], "most") == 0)
+		fewest = false;
+	else {
+		fprintf(stderr, "Unknown search order '%s'.\n", argv[5]);
+		return EXIT_FAILURE;
+	}
+	if (argc == 7)
+		n_threads = atoi(argv[6]);
+	if (max_down < 1 || top_n < 1 || n_threads < 1) {
+		fprintf(stderr, "max_down, top_n and n_threads must be positive.\n");
+		return EXIT_FAILURE;
+	}
+
+	double start = wall_time();
+	struct SlopeResult *results = search_slopes(F, max_down, fewest,
+			n_threads, &n);
+	double elapsed = wall_time() - start;
+
+	printf("Top %d slopes with the %s trees:\n", top_n,
+			fewest ? "fewest" : "most");
+	for (i=0; i<top_n && i<n; i++)
+		printf("\tright %d, down %d: %d trees\n", results[i].right,
+				results[i].down, results[i].trees);
+	printf("Evaluated %d slopes in %.3f seconds using %d thread(s).\n",
+			n, elapsed, n_threads);
+
+	free(results);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
-	if (argc != 2) {
+	bool search = (argc == 6 || argc == 7) && strcmp(argv[2], "search") == 0;
+	if (argc != 2 && !search) {
 		printf("Usage: %s input_file\n", argv[0]);
+		printf("       %s input_file search max_down top_n fewest|most "
+				"[n_threads]\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
 	long ans = -1;
+	int status = EXIT_SUCCESS;
+
+	if (!search && strcmp(argv[1], "-") == 0) {
+		struct Slope slopes[N_SLOPES];
+		memcpy(slopes, SLOPES, sizeof(SLOPES));
+		stream_tree_count_slopes(stdin, slopes, N_SLOPES);
+		printf("Solution part 1: %ld\n", slopes[1].trees);
+		printf("Solution part 2: %ld\n",
+				slopes_product(slopes, N_SLOPES));
+		return EXIT_SUCCESS;
+	}
 
 	struct Field *F = read_file(argv[1]);
 
-	ans = solve_part_one(F);
-	printf("Solution part 1: %ld\n", ans);
+	if (search) {
+		status = run_search(F, argc, argv);
+	} else {
+		ans = solve_part_one(F);
+		printf("Solution part 1: %ld\n", ans);
 
-	ans = solve_part_two(F);
-	printf("Solution part 2: %ld\n", ans);
+		ans = solve_part_two(F);
+		printf("Solution part 2: %ld\n", ans);
+	}
 
 	free(F->map);
 	free(F);
 
-	return EXIT_SUCCESS;
+	return status;
 }
@@ -21,281 +21,847 @@
 
  */
 
+// compile with gcc -Wall -O2 -pthread -o day04 ./day04.c
+// run with ./day04 input_day04.txt [rules_file|- [n_threads]]
+
+#include<fcntl.h>
+#include<pthread.h>
 #include<stdbool.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+
+#define INIT_CAPACITY 1024
+
+// Character classes and states of the passport tokenizer
+enum CharClass { C_CHAR, C_COLON, C_SPACE, C_NEWLINE, N_CLASSES };
+enum State { S_LINE_START, S_BLANK, S_SEP, S_KEY, S_VALUE, N_STATES };
+
+// Actions that are taken on a transition
+#define A_NONE 0
+#define A_KEY_START 1
+#define A_VAL_START 2
+#define A_FIELD_END 4
+#define A_RECORD_END 8
+
+// Every character not listed here is a C_CHAR
+const enum CharClass CHAR_CLASS[256] = {
+	[':'] = C_COLON,
+	[' '] = C_SPACE,
+	['\t'] = C_SPACE,
+	['\r'] = C_SPACE,
+	['\n'] = C_NEWLINE,
+};
+
+struct Transition {
+	enum State next;
+	int action;
+};
+
+// A blank line shows up as a newline while we're still at the start of a
+// line, which is what ends a record. S_BLANK is a line that held only
+// whitespace so far, so that lines with a '\r' (CRLF) or trailing spaces
+// are blank as well.
+const struct Transition TRANSITIONS[N_STATES][N_CLASSES] = {
+	[S_LINE_START] = {
+		[C_CHAR] = { S_KEY, A_KEY_START },
+		[C_COLON] = { S_VALUE, A_KEY_START | A_VAL_START },
+		[C_SPACE] = { S_BLANK, A_NONE },
+		[C_NEWLINE] = { S_LINE_START, A_RECORD_END },
+	},
+	[S_BLANK] = {
+		[C_CHAR] = { S_KEY, A_KEY_START },
+		[C_COLON] = { S_VALUE, A_KEY_START | A_VAL_START },
+		[C_SPACE] = { S_BLANK, A_NONE },
+		[C_NEWLINE] = { S_LINE_START, A_RECORD_END },
+	},
+	[S_SEP] = {
+		[C_CHAR] = { S_KEY, A_KEY_START },
+		[C_COLON] = { S_VALUE, A_KEY_START | A_VAL_START },
+		[C_SPACE] = { S_SEP, A_NONE },
+		[C_NEWLINE] = { S_LINE_START, A_NONE },
+	},
+	[S_KEY] = {
+		[C_CHAR] = { S_KEY, A_NONE },
+		[C_COLON] = { S_VALUE, A_VAL_START },
+		[C_SPACE] = { S_SEP, A_NONE },
+		[C_NEWLINE] = { S_LINE_START, A_NONE },
+	},
+	[S_VALUE] = {
+		[C_CHAR] = { S_VALUE, A_NONE },
+		[C_COLON] = { S_VALUE, A_NONE },
+		[C_SPACE] = { S_SEP, A_FIELD_END },
+		[C_NEWLINE] = { S_LINE_START, A_FIELD_END },
+	},
+};
 
-#define BUFSIZE 1024
+enum FieldId { BYR, IYR, EYR, HGT, HCL, ECL, PID, CID, N_FIELDS };
 
+const char *FIELD_NAMES[N_FIELDS] = {
+	"byr", "iyr", "eyr", "hgt", "hcl", "ecl", "pid", "cid"
+};
+
+// all fields except cid are required
+#define REQUIRED_FIELDS ((1 << N_FIELDS) - 1 - (1 << CID))
+
+// Pack a three letter key into a single integer
+#define KEY3(a, b, c) ((a) | ((b) << 8) | ((c) << 16))
+
+// A value in the input buffer (not null-terminated)
+struct View {
+	const char *str;
+	int len;
+};
+
+// Bit i of present is set if field i was given
 struct Passport {
-	char *byr;
-	char *iyr;
-	char *eyr;
-	char *hgt;
-	char *hcl;
-	char *ecl;
-	char *pid;
-	char *cid;
+	int present;
+	struct View fields[N_FIELDS];
+};
+
+// Validation rules. A rule spec has one rule per line, of the form
+//
+//	<field> range <min> <max>		digits only, min <= value <= max
+//	<field> unit <suffix> <min> <max> ...	digits followed by one of the
+//						suffixes, with a range per suffix
+//	<field> pattern <pattern>		fixed-length pattern of literal
+//						characters and [a-z0-9] classes,
+//						each optionally followed by {n}
+//	<field> enum <value> <value> ...	one of the values (max 8 chars)
+//
+// Empty lines and lines starting with '#' are ignored. Rules are compiled
+// into lookup tables when they're loaded.
+enum RuleType { R_RANGE, R_UNIT, R_PATTERN, R_ENUM };
+
+#define MAX_UNITS 4
+#define MAX_PATTERN 32
+#define MAX_ENUM 16
+#define MAX_PACKED 8
+#define VEC_WIDTH 16
+
+// Loads of VEC_WIDTH bytes that stay within one page can not fault, so short
+// values are read with a full vector load when possible.
+#define PAGE_SIZE 4096
+#define SAFE_LOAD(p) ((((uintptr_t) (p)) & (PAGE_SIZE - 1)) <= PAGE_SIZE - VEC_WIDTH)
+
+struct Unit {
+	uint64_t suffix;
+	int min;
+	int max;
+};
+
+struct Rule {
+	enum RuleType type;
+	int field;
+	// R_RANGE
+	int min;
+	int max;
+	// R_UNIT
+	int n_units;
+	struct Unit units[MAX_UNITS];
+	// R_PATTERN, a 256-bit character set for every position
+	int length;
+	uint64_t classes[MAX_PATTERN][4];
+	// Patterns of at most VEC_WIDTH characters where every class is made
+	// up of at most two ranges are also stored as [lo, hi] byte ranges, so
+	// they can be checked with a single vector load.
+	bool vector;
+	uint8_t lo[2][VEC_WIDTH];
+	uint8_t hi[2][VEC_WIDTH];
+	// R_ENUM, values are packed into integers
+	int n_values;
+	uint64_t values[MAX_ENUM];
+};
+
+struct Schema {
+	int n;
+	struct Rule *rules;
+};
+
+// A blank-line aligned piece of the input that is validated by one thread
+struct Chunk {
+	const char *start;
+	const char *end;
+	struct Schema *schema;
+	long valid_one;
+	long valid_two;
+};
+
+// Running counts of a thread. These live on the stack of the thread, since
+// neighbouring chunks share cache lines.
+struct Tally {
+	struct Schema *schema;
+	long valid_one;
+	long valid_two;
+};
+
+// The rules of part two
+const char *DEFAULT_RULES =
+	"byr range 1920 2002\n"
+	"iyr range 2010 2020\n"
+	"eyr range 2020 2030\n"
+	"hgt unit cm 150 193 in 59 76\n"
+	"hcl pattern #[0-9a-z]{6}\n"
+	"ecl enum amb blu brn gry grn hzl oth\n"
+	"pid pattern [0-9]{9}\n";
+
+// All passports of an input file. The field views point into the mapped
+// file, so it stays mapped until the list is freed.
+struct PassportList {
+	int n;
+	int capacity;
+	struct Passport *passports;
+	const char *data;
+	size_t size;
 };
 
-struct Passport *passport_init(void)
+void *Malloc(size_t size)
+{
+	void *out = malloc(size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+void *Realloc(void *ptr, size_t size)
+{
+	void *out = realloc(ptr, size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+const char *map_file(char *filename, size_t *size)
+{
+	int fd;
+	struct stat st;
+	const char *data = NULL;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error opening file %s for reading.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error reading size of file %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	*size = st.st_size;
+	if (*size > 0) {
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Error mapping file %s.\n", filename);
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+
+	return data;
+}
+
+void unmap_file(const char *data, size_t size)
 {
-	struct Passport *p = malloc(sizeof(struct Passport));
-	p->byr = NULL;
-	p->iyr = NULL;
-	p->eyr = NULL;
-	p->hgt = NULL;
-	p->hcl = NULL;
-	p->ecl = NULL;
-	p->pid = NULL;
-	p->cid = NULL;
-	return p;
+	if (data != NULL)
+		munmap((void *) data, size);
 }
 
-void passport_free(struct Passport *p)
+void passport_init(struct Passport *p)
 {
-	free(p->byr);
-	free(p->iyr);
-	free(p->eyr);
-	free(p->hgt);
-	free(p->hcl);
-	free(p->ecl);
-	free(p->pid);
-	free(p->cid);
-	free(p);
-	p = NULL;
+	p->present = 0;
 }
 
 void passport_print(struct Passport *p)
 {
 	printf("Passport:\n");
-	printf("\tbyr = %s\n", p->byr == NULL ? "" : p->byr);
-	printf("\tiyr = %s\n", p->iyr == NULL ? "" : p->iyr);
-	printf("\teyr = %s\n", p->eyr == NULL ? "" : p->eyr);
-	printf("\thgt = %s\n", p->hgt == NULL ? "" : p->hgt);
-	printf("\thcl = %s\n", p->hcl == NULL ? "" : p->hcl);
-	printf("\tecl = %s\n", p->ecl == NULL ? "" : p->ecl);
-	printf("\tpid = %s\n", p->pid == NULL ? "" : p->pid);
-	printf("\tcid = %s\n", p->cid == NULL ? "" : p->cid);
+	for (int i=0; i<N_FIELDS; i++) {
+		if (p->present & (1 << i))
+			printf("\t%s = %.*s\n", FIELD_NAMES[i],
+					p->fields[i].len, p->fields[i].str);
+		else
+			printf("\t%s = \n", FIELD_NAMES[i]);
+	}
 	printf("\n");
 }
 
-void passport_set(struct Passport *p, char *key, char *val)
+/** @brief Map a key to its field id
+ *
+ * The three letters of the key are packed into one integer, so finding the
+ * field takes a single switch instead of a chain of string comparisons.
+ * Returns -1 for unknown keys.
+ */
+int field_id(const char *key, size_t klen)
 {
-	size_t l = strlen(val);
-	char *buf = calloc(l+1, sizeof(char));
-	if (strcpy(buf, val) == NULL) {
-		fprintf(stderr, "Error copying value string.\n");
-		exit(EXIT_FAILURE);
+	if (klen != 3)
+		return -1;
+	switch (KEY3(key[0], key[1], key[2])) {
+		case KEY3('b', 'y', 'r'): return BYR;
+		case KEY3('i', 'y', 'r'): return IYR;
+		case KEY3('e', 'y', 'r'): return EYR;
+		case KEY3('h', 'g', 't'): return HGT;
+		case KEY3('h', 'c', 'l'): return HCL;
+		case KEY3('e', 'c', 'l'): return ECL;
+		case KEY3('p', 'i', 'd'): return PID;
+		case KEY3('c', 'i', 'd'): return CID;
 	}
+	return -1;
+}
 
-	if (strcmp(key, "byr") == 0) {
-		p->byr = buf;
-	} else if (strcmp(key, "iyr") == 0) {
-		p->iyr = buf;
-	} else if (strcmp(key, "eyr") == 0) {
-		p->eyr = buf;
-	} else if (strcmp(key, "hgt") == 0) {
-		p->hgt = buf;
-	} else if (strcmp(key, "hcl") == 0) {
-		p->hcl = buf;
-	} else if (strcmp(key, "ecl") == 0) {
-		p->ecl = buf;
-	} else if (strcmp(key, "pid") == 0) {
-		p->pid = buf;
-	} else if (strcmp(key, "cid") == 0) {
-		p->cid = buf;
-	} else {
-		fprintf(stderr, "Unknown key '%s', skipping.\n", key);
-		free(buf);
+void passport_set(struct Passport *p, const char *key, size_t klen,
+		const char *val, size_t vlen)
+{
+	int id = field_id(key, klen);
+	if (id < 0) {
+		fprintf(stderr, "Unknown key '%.*s', skipping.\n", (int) klen,
+				key);
+		return;
 	}
+	p->present |= 1 << id;
+	p->fields[id].str = val;
+	p->fields[id].len = vlen;
 }
 
-struct Passport **read_file(char *filename, int *N)
+/** @brief Scan all passports in a buffer
+ *
+ * This runs the tokenizer state machine over the buffer in a single pass.
+ * Keys and values are recognized by their start and end position in the
+ * buffer and passports only store views of the values, so nothing is copied.
+ * Every complete passport is handed to emit.
+ */
+void scan_passports(const char *data, size_t size,
+		void (*emit)(struct Passport *, void *), void *ctx)
 {
-	char u, v;
-	char *key = NULL,
-	     *val = NULL;
-	bool is_key = true;
-	FILE *fp = NULL;
-	struct Passport **pps = NULL;
-	struct Passport *p = NULL;
-	int n = 0;
+	size_t i,
+	       key = 0,
+	       key_end = 0,
+	       val = 0;
+	enum State state = S_LINE_START;
+	enum CharClass c;
+	struct Transition t;
+	struct Passport p;
+
+	passport_init(&p);
+	for (i=0; i<=size; i++) {
+		// the end of the buffer acts as a final newline
+		c = i < size ? CHAR_CLASS[(unsigned char) data[i]] : C_NEWLINE;
+		t = TRANSITIONS[state][c];
+		if (t.action & A_KEY_START)
+			key = i;
+		if (t.action & A_VAL_START) {
+			key_end = i;
+			val = i + 1;
+		}
+		if (t.action & A_FIELD_END)
+			passport_set(&p, data + key, key_end - key,
+					data + val, i - val);
+		if (((t.action & A_RECORD_END) || i == size) &&
+				p.present != 0) {
+			emit(&p, ctx);
+			passport_init(&p);
+		}
+		state = t.next;
+	}
+}
 
-	if ((fp = fopen(filename, "r")) == NULL) {
-		fprintf(stderr, "Error opening file %s for reading.\n", filename);
-		exit(EXIT_FAILURE);
+void append_passport(struct Passport *p, void *ctx)
+{
+	struct PassportList *L = ctx;
+	if (L->n == L->capacity) {
+		L->capacity *= 2;
+		L->passports = Realloc(L->passports,
+				sizeof(struct Passport) * L->capacity);
 	}
+	L->passports[L->n++] = *p;
+}
 
-	key = calloc(BUFSIZE, sizeof(char));
-	val = calloc(BUFSIZE, sizeof(char));
+struct PassportList *read_file(char *filename)
+{
+	struct PassportList *L = Malloc(sizeof(struct PassportList));
+	L->data = map_file(filename, &L->size);
+	L->n = 0;
+	L->capacity = INIT_CAPACITY;
+	L->passports = Malloc(sizeof(struct Passport) * L->capacity);
+	scan_passports(L->data, L->size, append_passport, L);
+	return L;
+}
 
-	v = fgetc(fp);
-	while ((u = v) && (v = fgetc(fp)) && (u != EOF)) {
-		if (u == '\n' && v == '\n') {
-			passport_set(p, key, val);
-			memset(key, 0, BUFSIZE);
-			memset(val, 0, BUFSIZE);
-			is_key = true;
+void passport_list_free(struct PassportList *L)
+{
+	free(L->passports);
+	unmap_file(L->data, L->size);
+	free(L);
+}
 
-			pps = realloc(pps, (n+1) * sizeof(struct Passport *));
-			pps[n++] = p;
-			p = NULL;
-			continue;
-		} else if (u == '\n' || u == ' ') {
-			p = (p == NULL) ? passport_init() : p;
-			if (!(strcmp(key, "") == 0)) { // hacky
-				passport_set(p, key, val);
+bool is_passport_valid_one(struct Passport *p)
+{
+	return (p->present & REQUIRED_FIELDS) == REQUIRED_FIELDS;
+}
+
+// Pack a string of at most MAX_PACKED characters into an integer
+uint64_t pack(const char *str, int len)
+{
+	uint64_t out = 0;
+	for (int i=0; i<len; i++)
+		out |= ((uint64_t) (unsigned char) str[i]) << (8 * i);
+	return out;
+}
+
+void rule_error(int line, const char *msg)
+{
+	fprintf(stderr, "Error in rule on line %d: %s\n", line, msg);
+	exit(EXIT_FAILURE);
+}
+
+int parse_int(char *tok, int line)
+{
+	char *end = NULL;
+	if (tok == NULL)
+		rule_error(line, "expected a number");
+	long num = strtol(tok, &end, 10);
+	if (*end != '\0' || num < 0 || num > 999999999)
+		rule_error(line, "invalid number");
+	return num;
+}
+
+void class_add(uint64_t *set, unsigned char c)
+{
+	set[c >> 6] |= ((uint64_t) 1) << (c & 63);
+}
+
+bool class_has(const uint64_t *set, unsigned char c)
+{
+	return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+void compile_pattern(struct Rule *r, const char *pat, int line)
+{
+	int i, n, c;
+	uint64_t set[4];
+
+	r->length = 0;
+	while (*pat != '\0') {
+		memset(set, 0, sizeof(set));
+		if (*pat == '[') {
+			pat++;
+			while (*pat != ']') {
+				if (*pat == '\0')
+					rule_error(line, "unterminated class");
+				if (pat[1] == '-' && pat[2] != ']' && pat[2] != '\0') {
+					for (c=(unsigned char) pat[0];
+							c<=(unsigned char) pat[2]; c++)
+						class_add(set, c);
+					pat += 3;
+				} else {
+					class_add(set, *pat++);
+				}
 			}
-			memset(key, 0, BUFSIZE);
-			memset(val, 0, BUFSIZE);
-			is_key = true;
-			continue;
-		} else if (u == ':') {
-			is_key = false;
-			continue;
+			pat++;
+		} else {
+			class_add(set, *pat++);
 		}
-		if (is_key)
-			strncat(key, &u, 1);
-		else
-			strncat(val, &u, 1);
+
+		n = 1;
+		if (*pat == '{') {
+			n = 0;
+			for (pat++; '0' <= *pat && *pat <= '9'; pat++)
+				n = 10 * n + (*pat - '0');
+			if (*pat++ != '}' || n < 1)
+				rule_error(line, "invalid repetition");
+		}
+		if (r->length + n > MAX_PATTERN)
+			rule_error(line, "pattern too long");
+		for (i=0; i<n; i++)
+			memcpy(r->classes[r->length++], set, sizeof(set));
 	}
-	if (p != NULL) {
-		pps = realloc(pps, (n+1) * sizeof(struct Passport *));
-		pps[n++] = p;
+}
+
+// Store the character classes of a pattern as byte ranges, if they fit
+void compile_vector(struct Rule *r)
+{
+	int i, c, k;
+
+	r->vector = false;
+	if (r->length > VEC_WIDTH)
+		return;
+
+	// positions past the end of the pattern accept anything, their bytes
+	// are masked off when checking
+	memset(r->lo, 0x00, sizeof(r->lo));
+	memset(r->hi, 0xff, sizeof(r->hi));
+	for (i=0; i<r->length; i++) {
+		k = 0;
+		for (c=0; c<256; c++) {
+			if (!class_has(r->classes[i], c))
+				continue;
+			if (c > 0 && class_has(r->classes[i], c - 1)) {
+				r->hi[k-1][i] = c;
+				continue;
+			}
+			if (k == 2)
+				return;
+			r->lo[k][i] = r->hi[k][i] = c;
+			k++;
+		}
+		// an empty class can't be stored as a range, so such a pattern
+		// is left to the scalar matcher (which never matches it)
+		if (k == 0)
+			return;
+		// a single range is repeated as the second range
+		if (k == 1) {
+			r->lo[1][i] = r->lo[0][i];
+			r->hi[1][i] = r->hi[0][i];
+		}
+	}
+	r->vector = true;
+}
+
+void compile_rule(struct Rule *r, char *spec, int line)
+{
+	char *tok = NULL,
+	     *field = strtok(spec, " \t"),
+	     *type = strtok(NULL, " \t");
+
+	if (field == NULL || type == NULL)
+		rule_error(line, "expected a field and a rule type");
+	memset(r, 0, sizeof(struct Rule));
+	if ((r->field = field_id(field, strlen(field))) < 0)
+		rule_error(line, "unknown field");
+
+	if (strcmp(type, "range") == 0) {
+		r->type = R_RANGE;
+		r->min = parse_int(strtok(NULL, " \t"), line);
+		r->max = parse_int(strtok(NULL, " \t"), line);
+	} else if (strcmp(type, "unit") == 0) {
+		r->type = R_UNIT;
+		while ((tok = strtok(NULL, " \t")) != NULL) {
+			if (r->n_units == MAX_UNITS)
+				rule_error(line, "too many units");
+			if (strlen(tok) > MAX_PACKED)
+				rule_error(line, "unit suffix too long");
+			r->units[r->n_units].suffix = pack(tok, strlen(tok));
+			r->units[r->n_units].min = parse_int(strtok(NULL, " \t"), line);
+			r->units[r->n_units].max = parse_int(strtok(NULL, " \t"), line);
+			r->n_units++;
+		}
+	} else if (strcmp(type, "pattern") == 0) {
+		r->type = R_PATTERN;
+		if ((tok = strtok(NULL, " \t")) == NULL)
+			rule_error(line, "expected a pattern");
+		compile_pattern(r, tok, line);
+		compile_vector(r);
+	} else if (strcmp(type, "enum") == 0) {
+		r->type = R_ENUM;
+		while ((tok = strtok(NULL, " \t")) != NULL) {
+			if (r->n_values == MAX_ENUM)
+				rule_error(line, "too many values");
+			if (strlen(tok) > MAX_PACKED)
+				rule_error(line, "value too long");
+			r->values[r->n_values++] = pack(tok, strlen(tok));
+		}
+	} else {
+		rule_error(line, "unknown rule type");
 	}
+}
 
-	fclose(fp);
-	free(key);
-	free(val);
+struct Schema *compile_schema(const char *spec)
+{
+	int line = 0;
+	char *copy = Malloc(strlen(spec) + 1),
+	     *ptr = copy,
+	     *next = NULL;
+	struct Schema *S = Malloc(sizeof(struct Schema));
+
+	S->n = 0;
+	S->rules = NULL;
+	strcpy(copy, spec);
+
+	for (; ptr != NULL; ptr = next) {
+		line++;
+		if ((next = strchr(ptr, '\n')) != NULL)
+			*next++ = '\0';
+		ptr[strcspn(ptr, "\r")] = '\0';
+		if (ptr[strspn(ptr, " \t")] == '\0' || ptr[0] == '#')
+			continue;
+		S->rules = Realloc(S->rules, sizeof(struct Rule) * (S->n + 1));
+		compile_rule(&S->rules[S->n++], ptr, line);
+	}
 
-	*N = n;
-	return pps;
+	free(copy);
+	return S;
 }
 
-bool is_passport_valid_one(struct Passport *p)
+struct Schema *read_schema(char *filename)
 {
-	bool is_valid = true;
-	is_valid &= (p->byr != NULL);
-	is_valid &= (p->iyr != NULL);
-	is_valid &= (p->eyr != NULL);
-	is_valid &= (p->hgt != NULL);
-	is_valid &= (p->hcl != NULL);
-	is_valid &= (p->ecl != NULL);
-	is_valid &= (p->pid != NULL);
-	return is_valid;
+	size_t size;
+	const char *data = map_file(filename, &size);
+	char *spec = Malloc(size + 1);
+	if (size > 0)
+		memcpy(spec, data, size);
+	spec[size] = '\0';
+	unmap_file(data, size);
+
+	struct Schema *S = compile_schema(spec);
+	free(spec);
+	return S;
 }
 
-bool is_valid_year(char *str, int year_min, int year_max)
+void schema_free(struct Schema *S)
 {
-	int year = atoi(str);
-	if (year == 0)
-		return false;
-	return (year_min <= year && year <= year_max);
+	free(S->rules);
+	free(S);
 }
 
-bool is_valid_height(char *hgt)
+#ifdef __SSE2__
+// Byte mask of the positions of the vector x whose bytes fall in [lo, hi],
+// with bounds given per position
+static inline int in_range_mask(__m128i x, const uint8_t *lo, const uint8_t *hi)
 {
-	size_t l = strlen(hgt);
-	if (l < 4 || l > 5)
-		return false;
-	char *sub = calloc(5, sizeof(char));
-	int num = 0;
-	if (hgt[3] == 'c' && hgt[4] == 'm') {
-		strncpy(sub, hgt, 3);
-		num = atoi(sub);
-		free(sub);
-		return (150 <= num && num <= 193);
-	} else if (hgt[2] == 'i' && hgt[3] == 'n') {
-		strncpy(sub, hgt, 2);
-		num = atoi(sub);
-		free(sub);
-		return (59 <= num && num <= 76);
-	}
-	free(sub);
-	return false;
+	__m128i vlo = _mm_loadu_si128((const __m128i *) lo),
+		vhi = _mm_loadu_si128((const __m128i *) hi);
+	__m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(x, vlo), x),
+		le = _mm_cmpeq_epi8(_mm_min_epu8(x, vhi), x);
+	return _mm_movemask_epi8(_mm_and_si128(ge, le));
 }
+#endif
 
-bool is_valid_hair_color(char *hcl)
+const uint8_t DIGIT_LO[VEC_WIDTH] = {
+	'0', '0', '0', '0', '0', '0', '0', '0',
+	'0', '0', '0', '0', '0', '0', '0', '0'
+};
+const uint8_t DIGIT_HI[VEC_WIDTH] = {
+	'9', '9', '9', '9', '9', '9', '9', '9',
+	'9', '9', '9', '9', '9', '9', '9', '9'
+};
+
+// Check whether the first len (at most VEC_WIDTH) characters of str are
+// digits, with a single vector compare where the load is safe
+bool all_digits(const char *str, int len)
 {
-	if (strlen(hcl) != 7)
-		return false;
-	if (hcl[0] != '#')
-		return false;
-	for (int i=1; i<7; i++)
-		if (!('0' <= hcl[i] && hcl[i] <= '9') && (!('a' <= hcl[i] && hcl[i] <= 'z')))
+#ifdef __SSE2__
+	if (SAFE_LOAD(str)) {
+		__m128i x = _mm_loadu_si128((const __m128i *) str);
+		int keep = (1 << len) - 1;
+		return (in_range_mask(x, DIGIT_LO, DIGIT_HI) & keep) == keep;
+	}
+#endif
+	for (int i=0; i<len; i++)
+		if (str[i] < '0' || str[i] > '9')
 			return false;
 	return true;
 }
 
-bool is_valid_eye_color(char *ecl)
+// Parse a value that consists of digits only. Returns -1 if it doesn't.
+int digits_to_int(const char *str, int len)
 {
-	if (strcmp(ecl, "amb") == 0) return true;
-	if (strcmp(ecl, "blu") == 0) return true;
-	if (strcmp(ecl, "brn") == 0) return true;
-	if (strcmp(ecl, "gry") == 0) return true;
-	if (strcmp(ecl, "grn") == 0) return true;
-	if (strcmp(ecl, "hzl") == 0) return true;
-	if (strcmp(ecl, "oth") == 0) return true;
-	return false;
+	int i, num = 0;
+	if (len < 1 || len > 9 || !all_digits(str, len))
+		return -1;
+	for (i=0; i<len; i++)
+		num = 10 * num + (str[i] - '0');
+	return num;
 }
 
-bool is_valid_passport_id(char *pid)
+/** @brief Check a value against a pattern rule
+ *
+ * For vector patterns all characters are compared against their ranges at
+ * once, e.g. the '#' and six hex digits of hcl or the nine digits of pid.
+ */
+bool match_pattern(const struct Rule *r, const struct View *v)
 {
-	if (strlen(pid) != 9)
+	int i;
+	bool ok = true;
+
+	if (v->len != r->length)
 		return false;
-	for (int i=0; i<9; i++)
-		if (!('0' <= pid[i] && pid[i] <= '9'))
-			return false;
-	return true;
+#ifdef __SSE2__
+	if (r->vector && SAFE_LOAD(v->str)) {
+		__m128i x = _mm_loadu_si128((const __m128i *) v->str);
+		int keep = (1 << r->length) - 1;
+		int mask = in_range_mask(x, r->lo[0], r->hi[0]) |
+			in_range_mask(x, r->lo[1], r->hi[1]);
+		return (mask & keep) == keep;
+	}
+#endif
+	for (i=0; i<r->length; i++)
+		ok &= class_has(r->classes[i], v->str[i]);
+	return ok;
 }
 
+bool check_rule(const struct Rule *r, const struct View *v)
+{
+	int i, k, num;
+	bool ok;
+	uint64_t packed;
+
+	switch (r->type) {
+		case R_RANGE:
+			num = digits_to_int(v->str, v->len);
+			return r->min <= num && num <= r->max;
+		case R_UNIT:
+			for (k=0; k<v->len && '0' <= v->str[k] && v->str[k] <= '9'; k++);
+			if (v->len - k > MAX_PACKED)
+				return false;
+			num = digits_to_int(v->str, k);
+			packed = pack(v->str + k, v->len - k);
+			for (i=0; i<r->n_units; i++)
+				if (packed == r->units[i].suffix)
+					return r->units[i].min <= num &&
+						num <= r->units[i].max;
+			return false;
+		case R_PATTERN:
+			return match_pattern(r, v);
+		case R_ENUM:
+			if (v->len > MAX_PACKED)
+				return false;
+			packed = pack(v->str, v->len);
+			ok = false;
+			for (i=0; i<r->n_values; i++)
+				ok |= packed == r->values[i];
+			return ok;
+	}
+	return false;
+}
 
-bool is_passport_valid_two(struct Passport *p)
+bool is_passport_valid_two(struct Passport *p, struct Schema *S)
 {
 	if (!is_passport_valid_one(p))
 		return false;
-	if (!is_valid_year(p->byr, 1920, 2002))
-		return false;
-	if (!is_valid_year(p->iyr, 2010, 2020))
-		return false;
-	if (!is_valid_year(p->eyr, 2020, 2030))
-		return false;
-	if (!is_valid_height(p->hgt))
-		return false;
-	if (!is_valid_hair_color(p->hcl))
-		return false;
-	if (!is_valid_eye_color(p->ecl))
-		return false;
-	if (!is_valid_passport_id(p->pid))
-		return false;
+	for (int i=0; i<S->n; i++) {
+		if (!(p->present & (1 << S->rules[i].field)))
+			return false;
+		if (!check_rule(&S->rules[i], &p->fields[S->rules[i].field]))
+			return false;
+	}
 	return true;
 }
+
+void count_passport(struct Passport *p, void *ctx)
+{
+	struct Tally *T = ctx;
+	T->valid_one += is_passport_valid_one(p);
+	T->valid_two += is_passport_valid_two(p, T->schema);
+}
+
+void *count_valid_chunk(void *arg)
+{
+	struct Chunk *C = arg;
+	struct Tally T = { C->schema, 0, 0 };
+	scan_passports(C->start, C->end - C->start, count_passport, &T);
+	C->valid_one = T.valid_one;
+	C->valid_two = T.valid_two;
+	return NULL;
+}
+
+// Find the start of the first passport that begins at or after p
+const char *next_record(const char *p, const char *end)
+{
+	const char *q = NULL;
+	for (; p < end; p++) {
+		if ((p = memchr(p, '\n', end - p)) == NULL)
+			return end;
+		// a blank line may hold whitespace, as in the tokenizer
+		for (q=p+1; q < end && CHAR_CLASS[(unsigned char) *q] == C_SPACE;
+				q++);
+		if (q < end && *q == '\n')
+			return q + 1;
+	}
+	return end;
+}
+
+/** @brief Count valid passports in a buffer using n_threads threads
+ *
+ * The buffer is split in roughly equal parts, and every split point is moved
+ * forward past the next blank line so that no passport is cut in two. Each
+ * thread parses and validates its own chunk without storing the passports,
+ * and the counts are summed afterwards.
+ */
+void count_valid_parallel(const char *data, size_t size, struct Schema *S,
+		int n_threads, long *valid_one, long *valid_two)
+{
+	int k;
+	const char *p = data,
+	      *end = data + size;
+	struct Chunk *chunks = Malloc(sizeof(struct Chunk) * n_threads);
+	pthread_t *threads = Malloc(sizeof(pthread_t) * n_threads);
+
+	for (k=0; k<n_threads; k++) {
+		chunks[k].start = p;
+		if (k == n_threads - 1) {
+			p = end;
+		} else {
+			p = data + (size / n_threads) * (k + 1);
+			p = next_record(p < chunks[k].start ?
+					chunks[k].start : p, end);
+		}
+		chunks[k].end = p;
+		chunks[k].schema = S;
+		if (pthread_create(&threads[k], NULL, count_valid_chunk,
+					&chunks[k]) != 0) {
+			fprintf(stderr, "Error creating thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	*valid_one = *valid_two = 0;
+	for (k=0; k<n_threads; k++) {
+		pthread_join(threads[k], NULL);
+		*valid_one += chunks[k].valid_one;
+		*valid_two += chunks[k].valid_two;
+	}
+
+	free(threads);
+	free(chunks);
+}
+
 int main(int argc, char **argv)
 {
-	if (argc != 2) {
-		printf("Usage: %s input_file\n", argv[0]);
+	if (argc < 2 || argc > 4) {
+		printf("Usage: %s input_file [rules_file|- [n_threads]]\n",
+				argv[0]);
+		return EXIT_FAILURE;
+	}
+	int i,
+	    n_threads = (argc == 4) ? atoi(argv[3]) : 1;
+	long valid_one = 0,
+	     valid_two = 0;
+	struct Schema *S = (argc >= 3 && strcmp(argv[2], "-") != 0) ?
+		read_schema(argv[2]) : compile_schema(DEFAULT_RULES);
+
+	if (n_threads < 1) {
+		fprintf(stderr, "Number of threads must be positive.\n");
 		return EXIT_FAILURE;
 	}
-	int ans, i, N;
-	struct Passport **passports = NULL;
-
-	passports = read_file(argv[1], &N);
 
-	ans = 0;
-	for (i=0; i<N; i++)
-		ans += is_passport_valid_one(passports[i]);
-	printf("Solution part 1: %d\n", ans);
+	if (n_threads > 1) {
+		size_t size;
+		const char *data = map_file(argv[1], &size);
+		count_valid_parallel(data, size, S, n_threads, &valid_one,
+				&valid_two);
+		unmap_file(data, size);
+	} else {
+		struct PassportList *L = read_file(argv[1]);
+		for (i=0; i<L->n; i++)
+			valid_one += is_passport_valid_one(&L->passports[i]);
+		for (i=0; i<L->n; i++)
+			valid_two += is_passport_valid_two(&L->passports[i], S);
+		passport_list_free(L);
+	}
 
-	ans = 0;
-	for (i=0; i<N; i++)
-		ans += is_passport_valid_two(passports[i]);
-	printf("Solution part 2: %d\n", ans);
+	printf("Solution part 1: %ld\n", valid_one);
+	printf("Solution part 2: %ld\n", valid_two);
 
-	for (i=0; i<N; i++)
-		passport_free(passports[i]);
-	free(passports);
+	schema_free(S);
 
 	return EXIT_SUCCESS;
 }
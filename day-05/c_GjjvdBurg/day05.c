@@ -21,104 +21,342 @@
 
  */
 
+// compile with gcc -Wall -O2 -o day05 ./day05.c
+// run with ./day05 input_day05.txt [row_bits col_bits]
+// or stream from stdin with ./day05 - < input_day05.txt
+
+#include<fcntl.h>
 #include<stdbool.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
 
-#define BUFSIZE 1024
+#define ROW_BITS 7
+#define COL_BITS 3
+#define MAX_CODE_LEN 31
+#define BLOCK_SIZE 32
+#define STREAM_BUFSIZE (1 << 16)
+#define WORD_BITS 64
 #define maximum(a, b) ((a) > (b)) ? (a) : (b)
 
-char **read_file(char *filename, int *N)
+// The seats of the aircraft. A code has row_bits F/B characters followed by
+// col_bits L/R characters.
+struct Geometry {
+	int row_bits;
+	int col_bits;
+	int code_len;
+	size_t n_seats;
+};
+
+// Bitmap of occupied seats, bit i of the map is set if seat i is taken
+struct Occupancy {
+	size_t n_words;
+	uint64_t *words;
+};
+
+// Everything we need to know about the boarding passes seen so far
+struct Seats {
+	long max;
+	struct Occupancy occ;
+};
+
+void *Malloc(size_t size)
+{
+	void *out = malloc(size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+const char *map_file(char *filename, size_t *size)
 {
-	FILE *fp = NULL;
-	char buf[BUFSIZE], *bp, **bps;
-	int i, l, n = 0;
+	int fd;
+	struct stat st;
+	const char *data = NULL;
 
-	if ((fp = fopen(filename, "r")) == NULL) {
+	if ((fd = open(filename, O_RDONLY)) < 0) {
 		fprintf(stderr, "Error opening file %s for reading.\n", filename);
 		exit(EXIT_FAILURE);
 	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error reading size of file %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
 
-	while (fgets(buf, BUFSIZE, fp) != NULL) {
-		n++;
+	*size = st.st_size;
+	if (*size > 0) {
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Error mapping file %s.\n", filename);
+			exit(EXIT_FAILURE);
+		}
 	}
+	close(fd);
 
-	fseek(fp, 0, SEEK_SET);
+	return data;
+}
 
-	bps = malloc(n * sizeof(char *));
+void unmap_file(const char *data, size_t size)
+{
+	if (data != NULL)
+		munmap((void *) data, size);
+}
 
-	for (i=0; i<n; i++) {
-		fgets(buf, BUFSIZE, fp);
-		l = strlen(buf);
-		bp = malloc(sizeof(char) * l);
-		strncpy(bp, buf, l-1);
-		bp[l-1] = '\0';
-		bps[i] = bp;
+void *Calloc(size_t n, size_t size)
+{
+	void *out = calloc(n, size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
 	}
-
-	fclose(fp);
-	*N = n;
-	return bps;
+	return out;
 }
 
-int bin_part(char *c, int l, int r) {
-	if (c[0] == 'F' || c[0] == 'L') {
-		if (l+2 == r)
-			return l;
-		return bin_part(c+1, l, l + (r - l)/2);
-	} else {
-		if (l+2 == r)
-			return r-1;
-		return bin_part(c+1, l + (r - l)/2, r);
+void init_geometry(struct Geometry *g, int row_bits, int col_bits)
+{
+	if (row_bits < 1 || col_bits < 1 || row_bits + col_bits > MAX_CODE_LEN) {
+		fprintf(stderr, "Invalid geometry of %d row and %d column bits.\n",
+				row_bits, col_bits);
+		exit(EXIT_FAILURE);
 	}
+	g->row_bits = row_bits;
+	g->col_bits = col_bits;
+	g->code_len = row_bits + col_bits;
+	g->n_seats = ((size_t) 1) << g->code_len;
+}
+
+// Reverse the order of the lowest len bits of x
+uint32_t reverse_bits(uint32_t x, int len)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	x = (x >> 16) | (x << 16);
+	return x >> (32 - len);
+}
+
+/** @brief Decode a boarding pass into a seat ID
+ *
+ * The seat ID is the code read as a binary number, with F and L as 0 and B
+ * and R as 1. Of these letters, only B and R have bit 2 unset.
+ */
+int get_seat_id(const char *bp, int len)
+{
+	int i, id = 0;
+	for (i=0; i<len; i++)
+		id = (id << 1) | !(bp[i] & 4);
+	return id;
 }
 
-int get_seat_id(char *bp)
+#ifdef __SSE2__
+// Bit i of the result is set if byte i of the block is a B or an R, and bit
+// i of newlines is set if byte i is a newline
+static inline uint32_t block_mask(const char *block, uint32_t *newlines)
 {
-	return 8 * bin_part(bp, 0, 128) + bin_part(bp+7, 0, 8);
+	__m128i four = _mm_set1_epi8(4),
+		zero = _mm_setzero_si128(),
+		nl = _mm_set1_epi8('\n');
+	__m128i x0 = _mm_loadu_si128((const __m128i *) block),
+		x1 = _mm_loadu_si128((const __m128i *) (block + 16));
+	uint32_t lo = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x0, four), zero)),
+		 hi = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x1, four), zero));
+	*newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(x0, nl)) |
+		(((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(x1, nl))) << 16);
+	return lo | (hi << 16);
 }
+#endif
 
-int find_seat(char **bps, int N)
+void occupancy_init(struct Occupancy *occ, struct Geometry *g)
 {
-	int i, seat;
+	occ->n_words = (g->n_seats + WORD_BITS - 1) / WORD_BITS;
+	occ->words = Calloc(occ->n_words, sizeof(uint64_t));
+}
+
+void occupancy_set(struct Occupancy *occ, size_t seat)
+{
+	occ->words[seat / WORD_BITS] |= ((uint64_t) 1) << (seat % WORD_BITS);
+}
+
+static inline void take_seat(struct Seats *S, long id)
+{
+	occupancy_set(&S->occ, id);
+	S->max = maximum(S->max, id);
+}
 
-	bool *present = malloc(sizeof(bool) * 128 * 8);
-	for (i=0; i<128*8; i++) present[i] = false;
+/** @brief Decode the boarding passes in a buffer into the seat map
+ *
+ * When every line holds a code of len characters, a block of 32 bytes holds
+ * 33 / (len + 1) full codes (three for the default 10-character codes). Such
+ * a block is decoded with two vector loads and movemasks, after which every
+ * code is a slice of the mask that only needs its bits reversed. A block is
+ * only decoded this way if all 32 bytes lie inside the buffer and its
+ * newlines are exactly at the ends of the codes. Otherwise a single line is
+ * decoded on its own, after which we go back to decoding blocks.
+ *
+ * Unless last is set, an incomplete line at the end of the buffer is left
+ * alone. The number of bytes that were processed is returned.
+ */
+size_t decode_seats(const char *data, size_t size, int len, bool last,
+		struct Seats *S)
+{
+	size_t i;
+	const char *p = data,
+	      *end = data + size;
 
-	for (i=0; i<N; i++)
-		present[get_seat_id(bps[i])] = true;
+#ifdef __SSE2__
+	int k,
+	    stride = len + 1,
+	    per_block = (BLOCK_SIZE + 1) / stride,
+	    step = per_block * stride,
+	    span = step > BLOCK_SIZE ? step : BLOCK_SIZE;
+	uint32_t mask, newlines,
+		 code_mask = (((uint32_t) 1) << len) - 1,
+		 window = step < BLOCK_SIZE ? (((uint32_t) 1) << step) - 1 : ~0u,
+		 expected = 0;
+	// the newlines that end the codes of a block, apart from the last one
+	// of 10-character codes, which is the 33rd byte
+	for (k=1; k<=per_block; k++)
+		if (k * stride - 1 < BLOCK_SIZE)
+			expected |= ((uint32_t) 1) << (k * stride - 1);
+#endif
 
-	for (i=1; i<N-1; i++)
-		if (present[i-1] && !present[i] && present[i+1])
-			seat = i;
+	while (p < end) {
+#ifdef __SSE2__
+		// the vector loads always read BLOCK_SIZE bytes, even if the
+		// codes in the block take up fewer
+		for (; p + span <= end; p += step) {
+			mask = block_mask(p, &newlines);
+			if ((newlines & window) != expected ||
+					(step > BLOCK_SIZE && p[step - 1] != '\n'))
+				break;
+			for (k=0; k<per_block; k++)
+				take_seat(S, reverse_bits((mask >> (k * stride)) &
+							code_mask, len));
+		}
+		if (p >= end)
+			break;
+#endif
+		for (i=0; p + i < end && p[i] != '\n'; i++);
+		if (p + i == end && !last)
+			break;
+		if (i == (size_t) len)
+			take_seat(S, get_seat_id(p, len));
+		else if (i > 0) {
+			fprintf(stderr, "Invalid boarding pass '%.*s'.\n",
+					(int) i, p);
+			exit(EXIT_FAILURE);
+		}
+		p += i + 1;
+	}
 
-	free(present);
-	return seat;
+	return p < end ? (size_t) (p - data) : size;
 }
 
+void read_file(char *filename, struct Geometry *g, struct Seats *S)
+{
+	size_t size;
+	const char *data = map_file(filename, &size);
+	decode_seats(data, size, g->code_len, true, S);
+	unmap_file(data, size);
+}
+
+/** @brief Decode boarding passes from a stream into the seat map
+ *
+ * The stream is read in blocks of STREAM_BUFSIZE bytes, and an incomplete
+ * line at the end of a block is carried over to the next one. Memory use
+ * therefore only depends on the number of seats, not on the input.
+ */
+void read_stream(FILE *fp, struct Geometry *g, struct Seats *S)
+{
+	char *buf = Malloc(STREAM_BUFSIZE);
+	size_t n, used, have = 0;
+	bool last = false;
+
+	while (!last) {
+		n = fread(buf + have, 1, STREAM_BUFSIZE - have, fp);
+		have += n;
+		last = (n == 0);
+		used = decode_seats(buf, have, g->code_len, last, S);
+		if (used == 0 && have == STREAM_BUFSIZE) {
+			fprintf(stderr, "Boarding pass too long.\n");
+			exit(EXIT_FAILURE);
+		}
+		memmove(buf, buf + used, have - used);
+		have -= used;
+	}
+	free(buf);
+}
+
+/** @brief Find the first free seat that has both neighbours taken
+ *
+ * This works a word of 64 seats at a time. Shifting a word left or right
+ * (carrying in the bit of the adjacent word) lines up every seat with its
+ * neighbour, so ~w & left & right has a bit set for every such gap, and
+ * the first one is found with ctz. Returns -1 if there's no such seat.
+ */
+long find_gap(struct Occupancy *occ)
+{
+	size_t i;
+	uint64_t w, prev = 0, next, left, right, gaps;
+
+	for (i=0; i<occ->n_words; i++) {
+		w = occ->words[i];
+		next = (i + 1 < occ->n_words) ? occ->words[i + 1] : 0;
+		left = (w << 1) | (prev >> (WORD_BITS - 1));
+		right = (w >> 1) | (next << (WORD_BITS - 1));
+		gaps = ~w & left & right;
+		if (gaps != 0)
+			return i * WORD_BITS + __builtin_ctzll(gaps);
+		prev = w;
+	}
+	return -1;
+}
 
 int main(int argc, char **argv)
 {
 
-	if (argc != 2) {
-		printf("Usage: %s input_file\n", argv[0]);
+	if (argc != 2 && argc != 4) {
+		printf("Usage: %s input_file [row_bits col_bits]\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	int i, N, ans = 0;
-	char **boarding_passes = read_file(argv[1], &N);
+	long seat;
+	struct Geometry g;
+	struct Seats S;
+
+	if (argc == 4)
+		init_geometry(&g, atoi(argv[2]), atoi(argv[3]));
+	else
+		init_geometry(&g, ROW_BITS, COL_BITS);
+
+	S.max = 0;
+	occupancy_init(&S.occ, &g);
+
+	if (strcmp(argv[1], "-") == 0)
+		read_stream(stdin, &g, &S);
+	else
+		read_file(argv[1], &g, &S);
 
-	for (i=0; i<N; i++)
-		ans = maximum(ans, get_seat_id(boarding_passes[i]));
-	printf("Solution part 1: %d\n", ans);
+	printf("Solution part 1: %ld\n", S.max);
 
-	ans = find_seat(boarding_passes, N);
-	printf("Solution part 2: %d\n", ans);
+	seat = find_gap(&S.occ);
+	if (seat < 0)
+		printf("Part 2: No solution.\n");
+	else
+		printf("Solution part 2: %ld\n", seat);
 
-	for (i=0; i<N; i++)
-		free(boarding_passes[i]);
-	free(boarding_passes);
+	free(S.occ.words);
 
 	return EXIT_SUCCESS;
 }
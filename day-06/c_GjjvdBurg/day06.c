@@ -21,162 +21,241 @@
 
  */
 
+// compile with gcc -Wall -O2 -pthread -o day06 ./day06.c
+// run with ./day06 input_day06.txt [n_threads]
+
+#include<fcntl.h>
+#include<pthread.h>
 #include<stdbool.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
 
-#define BUFSIZE 1024
-
+// The answers of a group as bitmasks, with bit j set for question 'a' + j.
+// any holds the questions that anyone answered and all those that everyone
+// answered.
 struct Group {
 	int n;
-	int *lengths;
-	char **answers;
+	uint32_t any;
+	uint32_t all;
+};
+
+// A blank-line aligned piece of the input that is counted by one thread
+struct Chunk {
+	const char *start;
+	const char *end;
+	long count_one;
+	long count_two;
 };
 
-struct Group *init_group(void)
+void *Malloc(size_t size)
 {
-	struct Group *g = malloc(sizeof(struct Group));
-	if (g == NULL) {
-		fprintf(stderr, "Failed to allocate memory for group\n");
+	void *out = malloc(size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
 		exit(EXIT_FAILURE);
 	}
-	g->n = 0;
-	g->lengths = NULL;
-	g->answers = NULL;
+	return out;
+}
+
+const char *map_file(char *filename, size_t *size)
+{
+	int fd;
+	struct stat st;
+	const char *data = NULL;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error opening file %s for reading.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error reading size of file %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	*size = st.st_size;
+	if (*size > 0) {
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Error mapping file %s.\n", filename);
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
 
-	return g;
+	return data;
 }
 
-void free_group(struct Group *g)
+void unmap_file(const char *data, size_t size)
 {
-	for (int i=0; i<g->n; i++)
-		free(g->answers[i]);
-	free(g->answers);
-	free(g->lengths);
-	free(g);
-	g = NULL;
+	if (data != NULL)
+		munmap((void *) data, size);
 }
 
-void print_group(struct Group *g)
+void init_group(struct Group *g)
 {
-	printf("Group:\n");
-	for (int i=0; i<g->n; i++)
-		printf("\t%02d: %s\n", i, g->answers[i]);
-	printf("\n");
+	g->n = 0;
+	g->any = 0;
+	g->all = ~((uint32_t) 0);
 }
 
-struct Group **read_file(char *filename, int *N)
+void print_group(struct Group *g)
 {
-	FILE *fp = NULL;
-	char buf[BUFSIZE];
-	char *answer = NULL;
-	int l, n = 0;
+	printf("Group(n = %d, any = %07x, all = %07x)\n", g->n, g->any,
+			g->all);
+}
 
-	if ((fp = fopen(filename, "r")) == NULL) {
-		fprintf(stderr, "Error opening file %s for reading.\n", filename);
-		exit(EXIT_FAILURE);
-	}
+uint32_t answer_mask(const char *answer, size_t len)
+{
+	uint32_t mask = 0;
+	for (size_t j=0; j<len; j++)
+		if ('a' <= answer[j] && answer[j] <= 'z')
+			mask |= ((uint32_t) 1) << (answer[j] - 'a');
+	return mask;
+}
 
-	struct Group *g = NULL;
-	struct Group **groups = NULL;
+void group_add(struct Group *g, uint32_t mask)
+{
+	g->n++;
+	g->any |= mask;
+	g->all &= mask;
+}
 
-	while ((fgets(buf, BUFSIZE, fp)) != NULL) {
-		if (g == NULL) {
-			g = init_group();
+int group_count_one(struct Group *g)
+{
+	return __builtin_popcount(g->any);
+}
 
-			groups = realloc(groups, (++n) * sizeof(struct Group *));
-			if (groups == NULL) {
-				fprintf(stderr, "Error allocating memory for groups\n");
-				exit(EXIT_FAILURE);
-			}
-			groups[n-1] = g;
-		}
+int group_count_two(struct Group *g)
+{
+	return __builtin_popcount(g->all);
+}
 
-		if (strcmp(buf, "\n") == 0) {
-			g = NULL;
-			continue;
+/** @brief Count the answers of all groups in a chunk
+ *
+ * Groups are counted as soon as they're complete, so only the current group
+ * is kept in memory.
+ */
+void *count_chunk(void *arg)
+{
+	struct Chunk *C = arg;
+	struct Group g;
+	const char *p = C->start,
+	      *eol = NULL;
+	size_t len;
+	long one = 0,
+	     two = 0;
+
+	// count in locals, as the chunks of different threads share cache
+	// lines
+	init_group(&g);
+	while (p < C->end) {
+		eol = memchr(p, '\n', C->end - p);
+		eol = (eol == NULL) ? C->end : eol;
+		len = eol - p;
+		if (len > 0 && p[len-1] == '\r')
+			len--;
+
+		// a blank line closes the current group
+		if (len > 0) {
+			group_add(&g, answer_mask(p, len));
+		} else if (g.n > 0) {
+			one += group_count_one(&g);
+			two += group_count_two(&g);
+			init_group(&g);
 		}
-
-		l = strlen(buf);
-		answer = malloc(sizeof(char) * l);
-		strncpy(answer, buf, l - 1);
-		answer[l - 1] = '\0';
-
-		g->answers = realloc(g->answers, (++g->n) * sizeof(char *));
-		g->lengths = realloc(g->lengths, (g->n) * sizeof(int));
-		g->answers[g->n-1] = answer;
-		g->lengths[g->n-1] = l - 1;
+		p = eol + 1;
 	}
-
-	fclose(fp);
-	*N = n;
-	return groups;
+	if (g.n > 0) {
+		one += group_count_one(&g);
+		two += group_count_two(&g);
+	}
+	C->count_one = one;
+	C->count_two = two;
+	return NULL;
 }
 
-int group_count_one(struct Group *g)
+// Find the start of the first group that begins at or after p
+const char *next_group(const char *p, const char *end)
 {
-	char *answer = NULL;
-	int i, j;
-	bool *answered = malloc(26 * sizeof(bool));
-	for (j=0; j<26; j++) answered[j] = false;
-
-	for (i=0; i<g->n; i++) {
-		answer = g->answers[i];
-		for (j=0; j<g->lengths[i]; j++)
-			answered[answer[j] - 'a'] = true;
+	for (; p < end; p++) {
+		if ((p = memchr(p, '\n', end - p)) == NULL)
+			return end;
+		if (p + 1 < end && p[1] == '\n')
+			return p + 2;
 	}
-
-	i = 0;
-	for (j=0; j<26; j++)
-		i += answered[j];
-
-	free(answered);
-	return i;
+	return end;
 }
 
-int group_count_two(struct Group *g)
+/** @brief Count the answers of all groups using n_threads threads
+ *
+ * The buffer is split in roughly equal parts, and every split point is moved
+ * forward past the next blank line so that no group is cut in two. The
+ * counts of all chunks are summed afterwards.
+ */
+void count_parallel(const char *data, size_t size, int n_threads,
+		long *count_one, long *count_two)
 {
-	char *answer = NULL;
-	int i, j;
-	int *answered = malloc(26 * sizeof(int));
-	for (j=0; j<26; j++) answered[j] = 0;
-
-	for (i=0; i<g->n; i++) {
-		answer = g->answers[i];
-		for (j=0; j<g->lengths[i]; j++)
-			answered[answer[j] - 'a']++;
+	int k;
+	const char *p = data,
+	      *end = data + size;
+	struct Chunk *chunks = Malloc(sizeof(struct Chunk) * n_threads);
+	pthread_t *threads = Malloc(sizeof(pthread_t) * n_threads);
+
+	for (k=0; k<n_threads; k++) {
+		chunks[k].start = p;
+		if (k == n_threads - 1) {
+			p = end;
+		} else {
+			p = data + (size / n_threads) * (k + 1);
+			p = next_group(p < chunks[k].start ?
+					chunks[k].start : p, end);
+		}
+		chunks[k].end = p;
+		if (pthread_create(&threads[k], NULL, count_chunk,
+					&chunks[k]) != 0) {
+			fprintf(stderr, "Error creating thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	*count_one = *count_two = 0;
+	for (k=0; k<n_threads; k++) {
+		pthread_join(threads[k], NULL);
+		*count_one += chunks[k].count_one;
+		*count_two += chunks[k].count_two;
 	}
 
-	i = 0;
-	for (j=0; j<26; j++)
-		i += answered[j] == g->n;
-	free(answered);
-	return i;
+	free(threads);
+	free(chunks);
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s input_file\n", argv[0]);
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s input_file [n_threads]\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	int i, n, ans = 0;
-	struct Group **groups = read_file(argv[1], &n);
+	int n_threads = (argc == 3) ? atoi(argv[2]) : 1;
+	long ans_one, ans_two;
+	size_t size;
 
-	for (i=0; i<n; i++)
-		ans += group_count_one(groups[i]);
-	printf("Solution part 1: %d\n", ans);
+	if (n_threads < 1) {
+		fprintf(stderr, "Number of threads must be positive.\n");
+		return EXIT_FAILURE;
+	}
 
-	ans = 0;
-	for (i=0; i<n; i++)
-		ans += group_count_two(groups[i]);
-	printf("Solution part 2: %d\n", ans);
+	const char *data = map_file(argv[1], &size);
+	count_parallel(data, size, n_threads, &ans_one, &ans_two);
+	unmap_file(data, size);
 
-	for (i=0; i<n; i++)
-		free_group(groups[i]);
-	free(groups);
+	printf("Solution part 1: %ld\n", ans_one);
+	printf("Solution part 2: %ld\n", ans_two);
 
 	return EXIT_SUCCESS;
 }
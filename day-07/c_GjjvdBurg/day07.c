@@ -21,258 +21,1209 @@
 
  */
 
-#include<regex.h> // POSIX regex.h
 #include<stdbool.h>
+#include<inttypes.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<time.h>
 
 #define BUFSIZE 1024
+#define INIT_CAPACITY 64
+#define NO_COLOR -1
 
-struct Rule {
-	char *own_color;
+// Status of the number of bags inside a colour
+enum CountStatus { COUNT_OK, COUNT_OVERFLOW, COUNT_CYCLE };
 
+// Hash table that interns colour names to dense integer ids. Slots hold an
+// id or NO_COLOR, and are probed linearly.
+struct ColorTable {
 	int n;
-	int *counts;
-	char **colors;
+	int n_slots;
+	int *slots;
+	uint32_t *hashes;
+	char **names;
+};
+
+// Scratch space of the graph searches, with an entry for every colour. A
+// search only touches the entries of the colours it visits and resets them
+// when it's done, so that a search over a few colours stays cheap. Between
+// searches mark and on_stack are false, index is -2 and comp is -1.
+struct Scratch {
+	bool *mark;
+	bool *on_stack;
+	int *index;
+	int *low;
+	int *edge;
+	int *comp;
+	int *remaining;
 };
 
+// All rules, stored as a graph in compressed sparse row format with room to
+// grow. The bags that colour i contains directly are children[j] (counts[j]
+// times), for j in [offsets[i], ends[i]), and the row can grow in place up
+// to limits[i]. Colours without a rule have no children. After loading the
+// rows are packed, so ends[i] = limits[i] = offsets[i+1]. Rule updates move
+// rows that outgrow their limit to the end of the arrays, of which n_slots
+// out of max_slots entries are in use.
+// The reverse graph is stored in the same way, with the bags that directly
+// contain colour i in parents[j] for j in [rev_offsets[i], rev_ends[i]).
+// Both graphs hold n_edges edges.
+// The total number of bags inside colour i is precomputed in contained[i],
+// which is only valid if status[i] is COUNT_OK.
 struct RuleList {
 	int n;
-	struct Rule **rules;
+	int n_edges;
+	struct ColorTable colors;
+	int *offsets;
+	int *ends;
+	int *limits;
+	int *children;
+	int *counts;
+	int n_slots;
+	int max_slots;
+	int *rev_offsets;
+	int *rev_ends;
+	int *rev_limits;
+	int *parents;
+	int rev_n_slots;
+	int rev_max_slots;
+	uint64_t *contained;
+	enum CountStatus *status;
+	struct Scratch scratch;
+};
+
+// Transitive closure of the rules. Row i of the bitset holds the colours that
+// colour i can eventually contain. Rows have room for capacity colours so
+// that colours can be added by rule updates.
+struct Closure {
+	int n;
+	int capacity;
+	int words;
+	int n_comps;
+	uint64_t *rows;
 };
 
-struct Rule *init_rule(void)
+// Edges in the order they are read, before they're put in the RuleList
+struct EdgeList {
+	int n;
+	int capacity;
+	int *parents;
+	int *children;
+	int *counts;
+};
+
+void *Malloc(size_t size)
 {
-	struct Rule *r = malloc(sizeof(struct Rule));
-	r->own_color = NULL;
-	r->n = 0;
-	r->counts = NULL;
-	r->colors = NULL;
-	return r;
+	void *out = malloc(size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
 }
 
-void print_rule(struct Rule *r)
+void *Realloc(void *ptr, size_t size)
 {
-	printf("Rule: own color = %s, can contain:\n", r->own_color);
-	for (int i=0; i<r->n; i++)
-		printf("\t%d %s\n", r->counts[i], r->colors[i]);
-	printf("\n");
+	void *out = realloc(ptr, size);
+	if (out == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	return out;
 }
 
-void free_rule(struct Rule *r)
+char *str_from_range(const char *start, const char *end)
 {
-	free(r->own_color);
-	free(r->counts);
-	for (int i=0; i<r->n; i++)
-		free(r->colors[i]);
-	free(r->colors);
-	free(r);
-	r = NULL;
+	size_t len = end - start;
+	char *buf = Malloc(sizeof(char) * (len + 1));
+	memcpy(buf, start, len);
+	buf[len] = '\0';
+	return buf;
 }
 
-struct RuleList *init_rule_list(void)
+// FNV-1a
+uint32_t hash_color(const char *str, size_t len)
 {
-	struct RuleList *l = malloc(sizeof(struct RuleList));
-	l->n = 0;
-	l->rules = NULL;
-	return l;
+	uint32_t h = 2166136261u;
+	for (size_t i=0; i<len; i++) {
+		h ^= (unsigned char) str[i];
+		h *= 16777619u;
+	}
+	return h;
 }
 
-void add_rule(struct RuleList *list, struct Rule *r)
+void init_color_table(struct ColorTable *t)
 {
-	list->rules = realloc(list->rules, (++list->n)*sizeof(struct Rule *));
-	if (list->rules == NULL) {
-		fprintf(stderr, "Insufficient memory for rule list.\n");
-		exit(EXIT_FAILURE);
+	t->n = 0;
+	t->n_slots = INIT_CAPACITY;
+	t->slots = Malloc(sizeof(int) * t->n_slots);
+	for (int i=0; i<t->n_slots; i++)
+		t->slots[i] = NO_COLOR;
+	t->hashes = NULL;
+	t->names = NULL;
+}
+
+void free_color_table(struct ColorTable *t)
+{
+	for (int i=0; i<t->n; i++)
+		free(t->names[i]);
+	free(t->names);
+	free(t->hashes);
+	free(t->slots);
+}
+
+// Double the number of slots. Names and hashes are indexed by id, so they
+// are reallocated whenever the table grows.
+void grow_color_table(struct ColorTable *t)
+{
+	int i, s, mask;
+
+	free(t->slots);
+	t->n_slots *= 2;
+	mask = t->n_slots - 1;
+	t->slots = Malloc(sizeof(int) * t->n_slots);
+	for (i=0; i<t->n_slots; i++)
+		t->slots[i] = NO_COLOR;
+	for (i=0; i<t->n; i++) {
+		for (s=t->hashes[i] & mask; t->slots[s] != NO_COLOR; s=(s+1) & mask);
+		t->slots[s] = i;
 	}
-	list->rules[list->n-1] = r;
+}
+
+/** @brief Find the id of a colour, optionally adding it to the table
+ *
+ * Returns NO_COLOR if the colour is not in the table and add is false.
+ */
+int color_id(struct ColorTable *t, const char *str, size_t len, bool add)
+{
+	int s, id,
+	    mask = t->n_slots - 1;
+	uint32_t h = hash_color(str, len);
+
+	for (s=h & mask; (id = t->slots[s]) != NO_COLOR; s=(s+1) & mask) {
+		if (t->hashes[id] == h && strncmp(t->names[id], str, len) == 0
+				&& t->names[id][len] == '\0')
+			return id;
+	}
+	if (!add)
+		return NO_COLOR;
+
+	id = t->n++;
+	t->slots[s] = id;
+	t->hashes = Realloc(t->hashes, sizeof(uint32_t) * t->n);
+	t->names = Realloc(t->names, sizeof(char *) * t->n);
+	t->hashes[id] = h;
+	t->names[id] = str_from_range(str, str + len);
+
+	// keep the load factor below 1/2
+	if (2 * t->n > t->n_slots)
+		grow_color_table(t);
+	return id;
+}
+
+void init_edge_list(struct EdgeList *e)
+{
+	e->n = 0;
+	e->capacity = INIT_CAPACITY;
+	e->parents = Malloc(sizeof(int) * e->capacity);
+	e->children = Malloc(sizeof(int) * e->capacity);
+	e->counts = Malloc(sizeof(int) * e->capacity);
+}
+
+void add_edge(struct EdgeList *e, int parent, int child, int count)
+{
+	if (e->n == e->capacity) {
+		e->capacity *= 2;
+		e->parents = Realloc(e->parents, sizeof(int) * e->capacity);
+		e->children = Realloc(e->children, sizeof(int) * e->capacity);
+		e->counts = Realloc(e->counts, sizeof(int) * e->capacity);
+	}
+	e->parents[e->n] = parent;
+	e->children[e->n] = child;
+	e->counts[e->n] = count;
+	e->n++;
+}
+
+void free_edge_list(struct EdgeList *e)
+{
+	free(e->parents);
+	free(e->children);
+	free(e->counts);
+}
+
+void print_rule(struct RuleList *list, int id)
+{
+	printf("Rule: own color = %s, can contain:\n", list->colors.names[id]);
+	for (int j=list->offsets[id]; j<list->ends[id]; j++)
+		printf("\t%d %s\n", list->counts[j],
+				list->colors.names[list->children[j]]);
+	printf("\n");
 }
 
 void print_rule_list(struct RuleList *list)
 {
 	for (int i=0; i<list->n; i++)
-		print_rule(list->rules[i]);
+		print_rule(list, i);
 }
 
-void free_rule_list(struct RuleList *list)
+void init_scratch(struct Scratch *s)
 {
-	int i;
-	for (i=0; i<list->n; i++)
-		free_rule(list->rules[i]);
-	free(list->rules);
-	free(list);
-	list = NULL;
+	s->mark = s->on_stack = NULL;
+	s->index = s->low = s->edge = s->comp = s->remaining = NULL;
 }
 
-char *str_from_match(const char *str, regmatch_t match)
+// Extend the scratch space from n_old to n colours
+void grow_scratch(struct Scratch *s, int n_old, int n)
 {
-	char *buf;
-	regoff_t off, len;
-	off = match.rm_so;
-	len = match.rm_eo - match.rm_so;
-	buf = malloc(sizeof(char) * (len + 1));
-	strncpy(buf, str+off, len);
-	buf[len] = '\0';
-	return buf;
+	size_t size = n > 0 ? n : 1;
+
+	s->mark = Realloc(s->mark, sizeof(bool) * size);
+	s->on_stack = Realloc(s->on_stack, sizeof(bool) * size);
+	s->index = Realloc(s->index, sizeof(int) * size);
+	s->low = Realloc(s->low, sizeof(int) * size);
+	s->edge = Realloc(s->edge, sizeof(int) * size);
+	s->comp = Realloc(s->comp, sizeof(int) * size);
+	s->remaining = Realloc(s->remaining, sizeof(int) * size);
+	for (int i=n_old; i<n; i++) {
+		s->mark[i] = s->on_stack[i] = false;
+		s->index[i] = -2;
+		s->comp[i] = -1;
+	}
 }
 
-int int_from_match(const char *str, regmatch_t match)
+void free_scratch(struct Scratch *s)
 {
-	char *tmp = str_from_match(str, match);
-	int num = atoi(tmp);
-	free(tmp);
-	return num;
+	free(s->mark);
+	free(s->on_stack);
+	free(s->index);
+	free(s->low);
+	free(s->edge);
+	free(s->comp);
+	free(s->remaining);
 }
 
-struct Rule *parse_rule(const char *str)
+void free_rule_list(struct RuleList *list)
 {
-	int cnt;
-	char *clr = NULL;
+	free_color_table(&list->colors);
+	free(list->offsets);
+	free(list->ends);
+	free(list->limits);
+	free(list->children);
+	free(list->counts);
+	free(list->rev_offsets);
+	free(list->rev_ends);
+	free(list->rev_limits);
+	free(list->parents);
+	free(list->contained);
+	free(list->status);
+	free_scratch(&list->scratch);
+	free(list);
+	list = NULL;
+}
 
-	struct Rule *rule = init_rule();
+/** @brief Parse a rule of the form
+ *
+ * 	<color> bags contain <n> <color> bag(s), <n> <color> bag(s).
+ *
+ * or "<color> bags contain no other bags.". This is a hand-written tokenizer
+ * that makes a single pass over the string. Colours are interned as they're
+ * seen and the edges of the rule are added to the edge list. Returns the id
+ * of the colour of the rule, or NO_COLOR if the line is not a rule.
+ */
+int parse_rule(const char *str, struct ColorTable *colors,
+		struct EdgeList *edges)
+{
+	int own, cnt;
+	const char *p = NULL,
+	      *end = NULL;
+	const char *contain = " bags contain ";
 
-	const char *re_1 = "^(.*) bags contain ";
-	const char *re_2 = "([0-9]+) ([a-z\\ ]+) bags?";
+	if ((p = strstr(str, contain)) == NULL)
+		return NO_COLOR;
 
-	int retval;
-	regex_t regex_1, regex_2;
-	regmatch_t match_1[2], match_2[128];
+	own = color_id(colors, str, p - str, true);
+	p += strlen(contain);
 
-	if (regcomp(&regex_1, re_1, REG_NEWLINE | REG_EXTENDED) != 0) {
-		fprintf(stderr, "Error compiling regex: re_1\n");
-		exit(EXIT_FAILURE);
+	while (true) {
+		while (*p == ' ' || *p == ',')
+			p++;
+		// this also stops at "no other bags." and the final period
+		if (*p < '0' || *p > '9')
+			break;
+
+		cnt = 0;
+		while ('0' <= *p && *p <= '9')
+			cnt = 10 * cnt + (*p++ - '0');
+		if (*p++ != ' ' || (end = strstr(p, " bag")) == NULL)
+			break;
+
+		add_edge(edges, own, color_id(colors, p, end - p, true), cnt);
+
+		p = end + strlen(" bag");
+		if (*p == 's')
+			p++;
 	}
-	if (regcomp(&regex_2, re_2, REG_NEWLINE | REG_EXTENDED) != 0) {
-		fprintf(stderr, "Error compiling regex: re_2\n");
-		exit(EXIT_FAILURE);
+
+	return own;
+}
+
+/** @brief Put edges in compressed sparse row format
+ *
+ * This is a counting sort of the edges by source, which keeps the order of
+ * the edges of every source.
+ */
+void edges_to_csr(int n, int n_edges, int *sources, int *targets,
+		int *values, int **offsets, int **out_targets, int **out_values)
+{
+	int i, j;
+	int *next = Malloc(sizeof(int) * (n > 0 ? n : 1));
+
+	*offsets = Malloc(sizeof(int) * (n + 1));
+	*out_targets = Malloc(sizeof(int) * (n_edges > 0 ? n_edges : 1));
+	if (values != NULL)
+		*out_values = Malloc(sizeof(int) * (n_edges > 0 ? n_edges : 1));
+
+	for (i=0; i<=n; i++)
+		(*offsets)[i] = 0;
+	for (j=0; j<n_edges; j++)
+		(*offsets)[sources[j] + 1]++;
+	for (i=0; i<n; i++)
+		(*offsets)[i + 1] += (*offsets)[i];
+
+	memcpy(next, *offsets, sizeof(int) * n);
+	for (j=0; j<n_edges; j++) {
+		i = next[sources[j]]++;
+		(*out_targets)[i] = targets[j];
+		if (values != NULL)
+			(*out_values)[i] = values[j];
 	}
+	free(next);
+}
 
-	retval = regexec(&regex_1, str, 2, match_1, 0);
-	if (retval != 0)
-		goto cleanup;
-	rule->own_color = str_from_match(str, match_1[1]);
+// Set the ends and limits of the rows of a packed graph, where every row
+// ends where the next one starts
+void init_rows(int n, int n_edges, int *offsets, int **ends, int **limits,
+		int *n_slots, int *max_slots)
+{
+	*ends = Malloc(sizeof(int) * (n > 0 ? n : 1));
+	*limits = Malloc(sizeof(int) * (n > 0 ? n : 1));
+	for (int i=0; i<n; i++)
+		(*ends)[i] = (*limits)[i] = offsets[i+1];
+	*n_slots = *max_slots = n_edges;
+}
 
-	for (int i=0; ; i++) {
-		if (regexec(&regex_2, str, 3, match_2, 0))
-			break;
+void build_csr(struct RuleList *list, struct EdgeList *e)
+{
+	list->n = list->colors.n;
+	list->n_edges = e->n;
+	edges_to_csr(list->n, e->n, e->parents, e->children, e->counts,
+			&list->offsets, &list->children, &list->counts);
+	init_rows(list->n, e->n, list->offsets, &list->ends, &list->limits,
+			&list->n_slots, &list->max_slots);
+	edges_to_csr(list->n, e->n, e->children, e->parents, NULL,
+			&list->rev_offsets, &list->parents, NULL);
+	init_rows(list->n, e->n, list->rev_offsets, &list->rev_ends,
+			&list->rev_limits, &list->rev_n_slots,
+			&list->rev_max_slots);
+	init_scratch(&list->scratch);
+	grow_scratch(&list->scratch, 0, list->n);
+}
 
-		cnt = int_from_match(str, match_2[1]);
-		clr = str_from_match(str, match_2[2]);
+/** @brief Recompute the number of bags inside the given colours
+ *
+ * Colours are processed in topological order, starting from the colours that
+ * contain nothing (or only colours outside the set, whose counts are final),
+ * so that all children of a colour are done before the colour itself. Each
+ * colour is therefore computed once, in O(V+E) for the set, as only the
+ * scratch entries of the set are used. The set must include all colours
+ * that contain one of its colours.
+ *
+ * Counts are 64-bit, and a count that doesn't fit is marked as
+ * COUNT_OVERFLOW (as are the counts of all colours containing it). Colours
+ * that are part of a cycle are never reached and are marked as COUNT_CYCLE,
+ * as are colours that contain a colour marked COUNT_CYCLE (which may be
+ * outside the set).
+ */
+void update_contained(struct RuleList *list, const int *verts, int n_verts)
+{
+	int i, j, bag, child, parent,
+	    head = 0,
+	    tail = 0;
+	uint64_t total, inner;
+	enum CountStatus st;
+	int *queue = Malloc(sizeof(int) * (n_verts > 0 ? n_verts : 1));
+	int *remaining = list->scratch.remaining;
+	bool *in_set = list->scratch.mark;
 
-		rule->n++;
-		rule->counts = realloc(rule->counts, sizeof(int) * rule->n);
-		rule->colors = realloc(rule->colors, sizeof(char *) * rule->n);
+	for (i=0; i<n_verts; i++)
+		in_set[verts[i]] = true;
 
-		rule->counts[rule->n - 1] = cnt;
-		rule->colors[rule->n - 1] = clr;
+	for (i=0; i<n_verts; i++) {
+		bag = verts[i];
+		list->status[bag] = COUNT_CYCLE;
+		remaining[bag] = 0;
+		for (j=list->offsets[bag]; j<list->ends[bag]; j++)
+			remaining[bag] += in_set[list->children[j]];
+		if (remaining[bag] == 0)
+			queue[tail++] = bag;
+	}
+
+	while (head < tail) {
+		bag = queue[head++];
+		total = 0;
+		st = COUNT_OK;
+		for (j=list->offsets[bag]; j<list->ends[bag]; j++) {
+			child = list->children[j];
+			// a cycle below wins over an overflow, as it does when
+			// the colour is never reached
+			if (list->status[child] == COUNT_CYCLE) {
+				st = COUNT_CYCLE;
+				break;
+			}
+			if (st != COUNT_OK)
+				continue;
+			// count * (1 + contained[child])
+			if (list->status[child] == COUNT_OVERFLOW ||
+					__builtin_add_overflow(1,
+						list->contained[child], &inner) ||
+					__builtin_mul_overflow(list->counts[j],
+						inner, &inner) ||
+					__builtin_add_overflow(total, inner,
+						&total))
+				st = COUNT_OVERFLOW;
+		}
+		list->contained[bag] = (st == COUNT_OK) ? total : 0;
+		list->status[bag] = st;
 
-		str += match_2[2].rm_eo;
+		for (j=list->rev_offsets[bag]; j<list->rev_ends[bag]; j++) {
+			parent = list->parents[j];
+			if (--remaining[parent] == 0)
+				queue[tail++] = parent;
+		}
 	}
 
-cleanup:
-	regfree(&regex_1);
-	regfree(&regex_2);
+	for (i=0; i<n_verts; i++)
+		in_set[verts[i]] = false;
+	free(queue);
+}
+
+int *all_colors(struct RuleList *list)
+{
+	int *verts = Malloc(sizeof(int) * (list->n > 0 ? list->n : 1));
+	for (int i=0; i<list->n; i++)
+		verts[i] = i;
+	return verts;
+}
+
+// Compute the number of bags inside every colour
+void compute_contained(struct RuleList *list)
+{
+	int n = list->n > 0 ? list->n : 1;
+	int *verts = all_colors(list);
 
-	return rule;
+	list->contained = Malloc(sizeof(uint64_t) * n);
+	list->status = Malloc(sizeof(enum CountStatus) * n);
+	update_contained(list, verts, list->n);
+	free(verts);
 }
 
 struct RuleList *read_file(char *filename)
 {
 	FILE *fp = NULL;
 	char buf[BUFSIZE];
+	struct EdgeList edges;
 
 	if ((fp = fopen(filename, "r")) == NULL) {
 		fprintf(stderr, "Error opening file %s for reading.\n", filename);
 		exit(EXIT_FAILURE);
 	}
 
-	struct RuleList *list = init_rule_list();
+	struct RuleList *list = Malloc(sizeof(struct RuleList));
+	init_color_table(&list->colors);
+	init_edge_list(&edges);
 
 	while ((fgets(buf, BUFSIZE, fp)) != NULL) {
-		buf[strlen(buf)-1] = '\0'; // trim newline
-		struct Rule *rule = parse_rule(buf);
-		if (rule == NULL)
-			continue;
-		add_rule(list, rule);
+		buf[strcspn(buf, "\r\n")] = '\0'; // trim newline
+		parse_rule(buf, &list->colors, &edges);
 	}
 
+	build_csr(list, &edges);
+	free_edge_list(&edges);
+	compute_contained(list);
+
 	fclose(fp);
 	return list;
 }
 
 int get_rule_index(struct RuleList *list, char *color)
 {
-	for (int i=0; i<list->n; i++)
-		if (strcmp(list->rules[i]->own_color, color) == 0)
-			return i;
-	return -1;
+	return color_id(&list->colors, color, strlen(color), false);
 }
 
-// wildly inefficient, should use caching
-bool bag_can_contain_other(struct Rule *r, char *other, struct RuleList *list)
+/** @brief Find all colours that can eventually contain the target colour
+ *
+ * This is a breadth-first search from the target over the reverse graph, so
+ * every ancestor and its edges are visited once, and nothing else is
+ * touched. The ids of the ancestors are returned in BFS order and their
+ * number is stored in n.
+ */
+int *ancestors(struct RuleList *list, int target, int *n)
 {
-	int i, ridx;
-	// first check level one
-	for (i=0; i<r->n; i++) {
-		if (strcmp(r->colors[i], other) == 0)
-			return true;
+	int j, bag, parent,
+	    head = 0,
+	    tail = 0,
+	    capacity = INIT_CAPACITY;
+	int *queue = Malloc(sizeof(int) * capacity);
+	bool *seen = list->scratch.mark;
+
+	seen[target] = true;
+	queue[tail++] = target;
+	while (head < tail) {
+		bag = queue[head++];
+		for (j=list->rev_offsets[bag]; j<list->rev_ends[bag]; j++) {
+			parent = list->parents[j];
+			if (seen[parent])
+				continue;
+			seen[parent] = true;
+			if (tail == capacity) {
+				capacity *= 2;
+				queue = Realloc(queue, sizeof(int) * capacity);
+			}
+			queue[tail++] = parent;
+		}
 	}
+	for (j=0; j<tail; j++)
+		seen[queue[j]] = false;
 
-	// now depth-first
-	for (i=0; i<r->n; i++) {
-		ridx = get_rule_index(list, r->colors[i]);
-		if (bag_can_contain_other(list->rules[ridx], other, list))
-			return true;
+	// drop the target itself from the front of the queue
+	*n = tail - 1;
+	memmove(queue, queue + 1, sizeof(int) * (tail - 1));
+	return queue;
+}
+
+int solution_part_one(struct RuleList *list, int target)
+{
+	int n;
+	free(ancestors(list, target, &n));
+	return n;
+}
+
+enum CountStatus contains_n_bags(struct RuleList *list, int bag, uint64_t *n)
+{
+	*n = list->contained[bag];
+	return list->status[bag];
+}
+
+double wall_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/** @brief Find the strongly connected components among the given colours
+ *
+ * This is an iterative version of Tarjan's algorithm, which only follows
+ * edges between colours in verts. The colours are written to order as their
+ * component is completed, so the colours of a component are contiguous, and
+ * the components are in reverse topological order: every component that a
+ * component can reach comes before it. The component of every colour in
+ * verts is stored in the comp scratch array, which the caller resets to -1
+ * when it's done. Returns the number of components.
+ */
+int strong_components(struct RuleList *list, const int *verts, int n_verts,
+		int *order)
+{
+	int i, v, w, top = 0, stack_top = 0, n_comps = 0, counter = 0,
+	    n_order = 0;
+	struct Scratch *sc = &list->scratch;
+	int *index = sc->index,
+	    *low = sc->low,
+	    *edge = sc->edge,
+	    *comp = sc->comp;
+	bool *on_stack = sc->on_stack;
+	int *call = Malloc(sizeof(int) * (n_verts > 0 ? n_verts : 1));
+	int *stack = Malloc(sizeof(int) * (n_verts > 0 ? n_verts : 1));
+
+	// -2 marks colours outside the set, -1 colours not visited yet
+	for (i=0; i<n_verts; i++)
+		index[verts[i]] = -1;
+
+	for (i=0; i<n_verts; i++) {
+		if (index[verts[i]] != -1)
+			continue;
+		v = verts[i];
+		call[top++] = v;
+		index[v] = low[v] = counter++;
+		edge[v] = list->offsets[v];
+		stack[stack_top++] = v;
+		on_stack[v] = true;
+
+		while (top > 0) {
+			v = call[top - 1];
+			if (edge[v] < list->ends[v]) {
+				w = list->children[edge[v]++];
+				if (index[w] == -1) {
+					index[w] = low[w] = counter++;
+					edge[w] = list->offsets[w];
+					stack[stack_top++] = w;
+					on_stack[w] = true;
+					call[top++] = w;
+				} else if (on_stack[w] && index[w] < low[v]) {
+					low[v] = index[w];
+				}
+				continue;
+			}
+
+			// all children of v are done
+			if (low[v] == index[v]) {
+				do {
+					w = stack[--stack_top];
+					on_stack[w] = false;
+					comp[w] = n_comps;
+					order[n_order++] = w;
+				} while (w != v);
+				n_comps++;
+			}
+			top--;
+			if (top > 0 && low[v] < low[call[top - 1]])
+				low[call[top - 1]] = low[v];
+		}
 	}
-	return false;
+
+	for (i=0; i<n_verts; i++)
+		index[verts[i]] = -2;
+	free(stack);
+	free(call);
+	return n_comps;
 }
 
+static inline uint64_t *closure_row(struct Closure *C, int i)
+{
+	return &C->rows[(size_t) i * C->words];
+}
 
-int solution_part_one(struct RuleList *list)
+/** @brief Recompute the rows of the closure for the given colours
+ *
+ * The rows are filled for one strongly connected component at a time, in
+ * reverse topological order, so the rows of all colours a component can
+ * reach are complete when it's processed. The colours of a component share
+ * their row, which is the OR of the children of its colours and the rows of
+ * children outside the component. Colours in a cycle (or with a rule that
+ * contains itself) thereby also contain themselves and each other. The set
+ * must include all colours that can contain one of its colours. Returns the
+ * number of components.
+ */
+int update_closure(struct Closure *C, struct RuleList *list, const int *verts,
+		int n_verts)
 {
-	int i, ans = 0;
+	int i, j, k, s, e, c, v, w, n_comps;
+	uint64_t *row = NULL, *other = NULL;
+	int *comp = list->scratch.comp;
+	int *order = Malloc(sizeof(int) * (n_verts > 0 ? n_verts : 1));
+
+	n_comps = strong_components(list, verts, n_verts, order);
+
+	for (s=0; s<n_verts; s=e) {
+		c = comp[order[s]];
+		for (e=s; e<n_verts && comp[order[e]] == c; e++);
+
+		row = closure_row(C, order[s]);
+		memset(row, 0, sizeof(uint64_t) * C->words);
+		for (i=s; i<e; i++) {
+			v = order[i];
+			for (j=list->offsets[v]; j<list->ends[v]; j++) {
+				w = list->children[j];
+				row[w / 64] |= ((uint64_t) 1) << (w % 64);
+				if (comp[w] == c)
+					continue;
+				other = closure_row(C, w);
+				for (k=0; k<C->words; k++)
+					row[k] |= other[k];
+			}
+		}
+		for (i=s+1; i<e; i++)
+			memcpy(closure_row(C, order[i]), row,
+					sizeof(uint64_t) * C->words);
+	}
+
+	for (i=0; i<n_verts; i++)
+		comp[verts[i]] = -1;
+	free(order);
+	return n_comps;
+}
+
+struct Closure *build_closure(struct RuleList *list)
+{
+	struct Closure *C = Malloc(sizeof(struct Closure));
+	int *verts = all_colors(list);
+
+	C->n = C->capacity = list->n;
+	C->words = (list->n + 63) / 64;
+	C->rows = calloc((size_t) C->n * C->words + 1, sizeof(uint64_t));
+	if (C->rows == NULL) {
+		fprintf(stderr, "Error allocating memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	C->n_comps = update_closure(C, list, verts, list->n);
+
+	free(verts);
+	return C;
+}
+
+// Make room for n colours, doubling the capacity if needed. New colours
+// don't contain anything.
+void grow_closure(struct Closure *C, int n)
+{
+	int i, capacity, words;
+	uint64_t *rows = NULL;
+
+	if (n > C->capacity) {
+		capacity = (2 * C->capacity > n) ? 2 * C->capacity : n;
+		words = (capacity + 63) / 64;
+		rows = calloc((size_t) capacity * words + 1, sizeof(uint64_t));
+		if (rows == NULL) {
+			fprintf(stderr, "Error allocating memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i=0; i<C->n; i++)
+			memcpy(&rows[(size_t) i * words], closure_row(C, i),
+					sizeof(uint64_t) * C->words);
+		free(C->rows);
+		C->rows = rows;
+		C->words = words;
+		C->capacity = capacity;
+	}
+	C->n = n;
+}
+
+bool can_contain(struct Closure *C, int a, int b)
+{
+	const uint64_t *row = closure_row(C, a);
+	return (row[b / 64] >> (b % 64)) & 1;
+}
+
+void free_closure(struct Closure *C)
+{
+	free(C->rows);
+	free(C);
+}
+
+/** @brief Answer "can A eventually contain B?" queries from a stream
+ *
+ * Every line holds a query of the form "<color A>, <color B>", and the answer
+ * is printed as "yes" or "no". Build time, memory and query throughput are
+ * reported on stderr.
+ */
+void run_queries(struct RuleList *list, FILE *fp)
+{
+	char *line = NULL, *sep = NULL;
+	size_t cap = 0,
+	       n_queries = 0;
+	ssize_t len;
+	int a, b;
+
+	double start = wall_time();
+	struct Closure *C = build_closure(list);
+	double build = wall_time() - start;
+
+	start = wall_time();
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if ((sep = strstr(line, ", ")) == NULL) {
+			printf("invalid query\n");
+			continue;
+		}
+		a = color_id(&list->colors, line, sep - line, false);
+		b = color_id(&list->colors, sep + 2, strlen(sep + 2), false);
+		if (a == NO_COLOR || b == NO_COLOR)
+			printf("unknown color\n");
+		else
+			printf(can_contain(C, a, b) ? "yes\n" : "no\n");
+		n_queries++;
+	}
+	double elapsed = wall_time() - start;
+
+	fprintf(stderr, "Closure of %d colors (%d components) built in %.3f "
+			"seconds, using %.1f MB.\n", C->n, C->n_comps, build,
+			(double) C->n * C->words * sizeof(uint64_t) / 1e6);
+	fprintf(stderr, "Answered %zu queries in %.3f seconds (%.0f queries "
+			"per second).\n", n_queries, elapsed,
+			elapsed > 0 ? n_queries / elapsed : 0.0);
+
+	free(line);
+	free_closure(C);
+}
+
+// Extend the rule list to all colours in the colour table. New colours don't
+// contain anything, and their rows have no room yet.
+void grow_rule_list(struct RuleList *list)
+{
+	int i, n = list->colors.n;
+
+	if (n == list->n)
+		return;
+	list->offsets = Realloc(list->offsets, sizeof(int) * (n + 1));
+	list->ends = Realloc(list->ends, sizeof(int) * n);
+	list->limits = Realloc(list->limits, sizeof(int) * n);
+	list->rev_offsets = Realloc(list->rev_offsets, sizeof(int) * (n + 1));
+	list->rev_ends = Realloc(list->rev_ends, sizeof(int) * n);
+	list->rev_limits = Realloc(list->rev_limits, sizeof(int) * n);
+	list->contained = Realloc(list->contained, sizeof(uint64_t) * n);
+	list->status = Realloc(list->status, sizeof(enum CountStatus) * n);
+	for (i=list->n; i<n; i++) {
+		list->offsets[i] = list->ends[i] = list->limits[i] =
+			list->n_slots;
+		list->rev_offsets[i] = list->rev_ends[i] = list->rev_limits[i] =
+			list->rev_n_slots;
+		list->contained[i] = 0;
+		list->status[i] = COUNT_OK;
+	}
+	grow_scratch(&list->scratch, list->n, n);
+	list->n = n;
+}
+
+/** @brief Make room for need entries in row i of a graph
+ *
+ * A row that doesn't fit within its limit is moved to the end of the arrays
+ * with room for twice as many entries, so that growing a row one entry at a
+ * time costs O(1) amortized. The arrays themselves grow by doubling. The
+ * values may be NULL.
+ */
+void reserve_row(int i, int need, int *offsets, int *ends, int *limits,
+		int **targets, int **values, int *n_slots, int *max_slots)
+{
+	int len = ends[i] - offsets[i],
+	    room = 2 * need;
+
+	if (offsets[i] + need <= limits[i])
+		return;
+
+	if (*n_slots + room > *max_slots) {
+		*max_slots = (2 * *max_slots > *n_slots + room) ?
+			2 * *max_slots : *n_slots + room;
+		*targets = Realloc(*targets, sizeof(int) * *max_slots);
+		if (values != NULL)
+			*values = Realloc(*values, sizeof(int) * *max_slots);
+	}
+	memcpy(*targets + *n_slots, *targets + offsets[i], sizeof(int) * len);
+	if (values != NULL)
+		memcpy(*values + *n_slots, *values + offsets[i],
+				sizeof(int) * len);
+	offsets[i] = *n_slots;
+	ends[i] = offsets[i] + len;
+	limits[i] = offsets[i] + room;
+	*n_slots += room;
+}
+
+/** @brief Pack the rows of a graph that holds n_edges edges
+ *
+ * This drops the space that moved rows left behind, and is done when that
+ * makes up most of the arrays, so its O(V+E) cost is amortized over the
+ * updates that moved the rows.
+ */
+void pack_rows(int n, int n_edges, int *offsets, int *ends, int *limits,
+		int **targets, int **values, int *n_slots, int *max_slots)
+{
+	int i, len, k = 0;
+	int *new_targets = Malloc(sizeof(int) * (n_edges > 0 ? n_edges : 1));
+	int *new_values = NULL;
+
+	if (values != NULL)
+		new_values = Malloc(sizeof(int) * (n_edges > 0 ? n_edges : 1));
+	for (i=0; i<n; i++) {
+		len = ends[i] - offsets[i];
+		memcpy(new_targets + k, *targets + offsets[i], sizeof(int) * len);
+		if (values != NULL)
+			memcpy(new_values + k, *values + offsets[i],
+					sizeof(int) * len);
+		offsets[i] = k;
+		k += len;
+		ends[i] = limits[i] = k;
+	}
+
+	free(*targets);
+	*targets = new_targets;
+	if (values != NULL) {
+		free(*values);
+		*values = new_values;
+	}
+	*n_slots = *max_slots = n_edges;
+}
+
+/** @brief Replace the rule of a colour in both the graph and the reverse graph
+ *
+ * The old children of the colour drop it from their parents by swapping it
+ * with their last parent, and the new children append it. This costs
+ * O(size of the old and new rule + parents of its children), amortized.
+ */
+void replace_rule(struct RuleList *list, int own, const int *children,
+		const int *counts, int n_children)
+{
+	int j, c, pos;
+
+	for (j=list->offsets[own]; j<list->ends[own]; j++) {
+		c = list->children[j];
+		for (pos=list->rev_offsets[c]; list->parents[pos] != own; pos++);
+		list->parents[pos] = list->parents[--list->rev_ends[c]];
+	}
+	list->n_edges -= list->ends[own] - list->offsets[own];
+	list->ends[own] = list->offsets[own];
+
+	reserve_row(own, n_children, list->offsets, list->ends, list->limits,
+			&list->children, &list->counts, &list->n_slots,
+			&list->max_slots);
+	if (n_children > 0) {
+		memcpy(list->children + list->offsets[own], children,
+				sizeof(int) * n_children);
+		memcpy(list->counts + list->offsets[own], counts,
+				sizeof(int) * n_children);
+	}
+	list->ends[own] += n_children;
+
+	for (j=0; j<n_children; j++) {
+		c = children[j];
+		reserve_row(c, list->rev_ends[c] - list->rev_offsets[c] + 1,
+				list->rev_offsets, list->rev_ends,
+				list->rev_limits, &list->parents, NULL,
+				&list->rev_n_slots, &list->rev_max_slots);
+		list->parents[list->rev_ends[c]++] = own;
+	}
+	list->n_edges += n_children;
+
+	if (list->n_slots > 2 * list->n_edges + list->n)
+		pack_rows(list->n, list->n_edges, list->offsets, list->ends,
+				list->limits, &list->children, &list->counts,
+				&list->n_slots, &list->max_slots);
+	if (list->rev_n_slots > 2 * list->n_edges + list->n)
+		pack_rows(list->n, list->n_edges, list->rev_offsets,
+				list->rev_ends, list->rev_limits,
+				&list->parents, NULL, &list->rev_n_slots,
+				&list->rev_max_slots);
+}
+
+/** @brief Apply an update to the rules
+ *
+ * An update is either a rule, which is added or replaces the existing rule
+ * of its colour, or "remove <color>", which removes the rule of a colour.
+ * Only the colour of the rule and the colours that can contain it are
+ * affected, so only their bag counts and closure rows are recomputed.
+ * Returns the colour of the rule, or NO_COLOR if the update is invalid.
+ */
+int apply_update(struct RuleList *list, struct Closure *C, const char *line)
+{
+	int own, n;
+	int *verts = NULL;
+	struct EdgeList edges;
+	const char *remove = "remove ";
+
+	init_edge_list(&edges);
+	if (strncmp(line, remove, strlen(remove)) == 0)
+		own = get_rule_index(list, (char *) line + strlen(remove));
+	else
+		own = parse_rule(line, &list->colors, &edges);
+	if (own == NO_COLOR) {
+		free_edge_list(&edges);
+		return NO_COLOR;
+	}
+
+	grow_rule_list(list);
+	grow_closure(C, list->n);
+	replace_rule(list, own, edges.children, edges.counts, edges.n);
+	free_edge_list(&edges);
+
+	verts = ancestors(list, own, &n);
+	verts = Realloc(verts, sizeof(int) * (n + 1));
+	verts[n++] = own;
+	update_contained(list, verts, n);
+	update_closure(C, list, verts, n);
+
+	free(verts);
+	return own;
+}
+
+// Copy the rules of a rule list, without the colour names, as a packed graph
+struct RuleList *copy_rules(struct RuleList *list)
+{
+	int i, len, k = 0;
+	size_t edges = sizeof(int) * (list->n_edges > 0 ? list->n_edges : 1);
+	struct RuleList *copy = Malloc(sizeof(struct RuleList));
+
+	init_color_table(&copy->colors);
+	copy->n = list->n;
+	copy->n_edges = list->n_edges;
+	copy->offsets = Malloc(sizeof(int) * (list->n + 1));
+	copy->children = Malloc(edges);
+	copy->counts = Malloc(edges);
 	for (i=0; i<list->n; i++) {
-		ans += bag_can_contain_other(list->rules[i], "shiny gold", list);
+		len = list->ends[i] - list->offsets[i];
+		memcpy(copy->children + k, list->children + list->offsets[i],
+				sizeof(int) * len);
+		memcpy(copy->counts + k, list->counts + list->offsets[i],
+				sizeof(int) * len);
+		copy->offsets[i] = k;
+		k += len;
 	}
-	return ans;
+	copy->offsets[list->n] = k;
+	init_rows(copy->n, copy->n_edges, copy->offsets, &copy->ends,
+			&copy->limits, &copy->n_slots, &copy->max_slots);
+	init_scratch(&copy->scratch);
+	grow_scratch(&copy->scratch, 0, copy->n);
+	return copy;
+}
+
+// Compute the reverse graph, bag counts and closure of a packed graph from
+// scratch
+struct Closure *rebuild(struct RuleList *list)
+{
+	int i, j;
+	int *sources = Malloc(sizeof(int) *
+			(list->n_edges > 0 ? list->n_edges : 1));
+
+	for (i=0; i<list->n; i++)
+		for (j=list->offsets[i]; j<list->ends[i]; j++)
+			sources[j] = i;
+
+	edges_to_csr(list->n, list->n_edges, list->children, sources, NULL,
+			&list->rev_offsets, &list->parents, NULL);
+	init_rows(list->n, list->n_edges, list->rev_offsets, &list->rev_ends,
+			&list->rev_limits, &list->rev_n_slots,
+			&list->rev_max_slots);
+	free(sources);
+
+	compute_contained(list);
+	return build_closure(list);
 }
 
-// again, inefficient without caching
-int contains_n_bags(struct Rule *bag, struct RuleList *list)
+// Count the colours whose bag count or closure row differs between two
+// versions of the same rules
+int count_differences(struct RuleList *a, struct Closure *A,
+		struct RuleList *b, struct Closure *B)
 {
-	int idx, n = 0;
-	for (int i=0; i<bag->n; i++) {
-		n += bag->counts[i];
+	int i,
+	    diff = 0,
+	    words = A->words < B->words ? A->words : B->words;
 
-		idx = get_rule_index(list, bag->colors[i]);
-		n += bag->counts[i] * contains_n_bags(list->rules[idx], list);
+	for (i=0; i<a->n; i++) {
+		if (a->status[i] != b->status[i] ||
+				(a->status[i] == COUNT_OK &&
+				 a->contained[i] != b->contained[i]) ||
+				memcmp(closure_row(A, i), closure_row(B, i),
+					sizeof(uint64_t) * words) != 0)
+			diff++;
 	}
-	return n;
+	return diff;
 }
 
-int solution_part_two(struct RuleList *list)
+/** @brief Apply a stream of rule updates
+ *
+ * Every line holds an update for apply_update. The mean and maximum latency
+ * of the updates are reported on stderr, together with the time of a full
+ * rebuild of the bag counts and closure for the final rules. The rebuild is
+ * done on a copy of the rules and compared to the incremental state, which
+ * is left in place for the answers.
+ */
+void run_updates(struct RuleList *list, FILE *fp)
 {
-	int sgidx = get_rule_index(list, "shiny gold");
-	struct Rule *shinygold = list->rules[sgidx];
-	return contains_n_bags(shinygold, list);
+	char *line = NULL;
+	size_t cap = 0,
+	       n_updates = 0;
+	ssize_t len;
+	int diff;
+	double start, elapsed,
+	       total = 0,
+	       slowest = 0;
+
+	struct Closure *C = build_closure(list),
+		       *fresh_closure = NULL;
+	struct RuleList *fresh = NULL;
+
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0')
+			continue;
+		start = wall_time();
+		if (apply_update(list, C, line) == NO_COLOR) {
+			fprintf(stderr, "Invalid update '%s'.\n", line);
+			continue;
+		}
+		elapsed = wall_time() - start;
+		total += elapsed;
+		if (elapsed > slowest)
+			slowest = elapsed;
+		n_updates++;
+	}
+
+	fresh = copy_rules(list);
+	start = wall_time();
+	fresh_closure = rebuild(fresh);
+	elapsed = wall_time() - start;
+	diff = count_differences(list, C, fresh, fresh_closure);
+
+	fprintf(stderr, "Applied %zu updates in %.3f seconds (mean %.1f us, "
+			"max %.1f us per update).\n", n_updates, total,
+			n_updates > 0 ? 1e6 * total / n_updates : 0.0,
+			1e6 * slowest);
+	fprintf(stderr, "Full rebuild of %d colors took %.1f us.\n", list->n,
+			1e6 * elapsed);
+	if (diff > 0)
+		fprintf(stderr, "Incremental state differs from the full "
+				"rebuild for %d colors.\n", diff);
+
+	free(line);
+	free_closure(fresh_closure);
+	free_rule_list(fresh);
+	free_closure(C);
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s input_file\n", argv[0]);
+	bool update = argc >= 3 && strcmp(argv[2], "update") == 0;
+	if (argc < 2 || argc > 3 + update) {
+		fprintf(stderr, "Usage: %s input_file [color]\n", argv[0]);
+		fprintf(stderr, "       %s input_file query < queries\n",
+				argv[0]);
+		fprintf(stderr, "       %s input_file update [color] < updates\n",
+				argv[0]);
 		return EXIT_FAILURE;
 	}
-	int ans;
+	int ans, target;
+	uint64_t n_bags;
+	char *color = (argc == 3 + update) ? argv[2 + update] : "shiny gold";
 
 	struct RuleList *list = read_file(argv[1]);
 
-	ans = solution_part_one(list);
+	if (!update && strcmp(color, "query") == 0) {
+		run_queries(list, stdin);
+		free_rule_list(list);
+		return EXIT_SUCCESS;
+	}
+	if (update)
+		run_updates(list, stdin);
+
+	if ((target = get_rule_index(list, color)) == NO_COLOR) {
+		fprintf(stderr, "Unknown color '%s'.\n", color);
+		free_rule_list(list);
+		return EXIT_FAILURE;
+	}
+
+	ans = solution_part_one(list, target);
 	printf("Solution part 1: %d\n", ans);
 
-	ans = solution_part_two(list);
-	printf("Solution part 2: %d\n", ans);
+	switch (contains_n_bags(list, target, &n_bags)) {
+		case COUNT_OK:
+			printf("Solution part 2: %" PRIu64 "\n", n_bags);
+			break;
+		case COUNT_OVERFLOW:
+			printf("Part 2: More than %" PRIu64 " bags.\n",
+					UINT64_MAX);
+			break;
+		case COUNT_CYCLE:
+			printf("Part 2: Infinitely many bags (cyclic rules).\n");
+			break;
+	}
 
 	free_rule_list(list);
 
@@ -24,6 +24,8 @@
 #include<stdio.h>
 #include<stdlib.h>
 
+#include "sort.h"
+
 #define BUFSIZE 1024
 
 int *read_file(char *filename, int *N)
@@ -56,17 +58,13 @@ int *read_file(char *filename, int *N)
 	return jolts;
 }
 
-int cmp(const void *a, const void *b) {
-	return (*(int *)a - *(int *)b);
-}
-
 int solution_part_one(int *jolts, int N)
 {
 	int n_one = 0,
 	    n_three = 0;
 	int i, jolt = 0;
 
-	qsort(jolts, N, sizeof(int), cmp);
+	sort_ints(jolts, N);
 
 	for (i=0; i<N; i++) {
 		if (jolts[i] - jolt == 1)